@@ -70,6 +70,19 @@ client_get_geometry(Client *c, struct wlr_box *geom)
 	wlr_xdg_surface_get_geometry(c->surface.xdg, geom);
 }
 
+static inline pid_t
+client_get_pid(Client *c)
+{
+	pid_t pid;
+#ifdef XWAYLAND
+	if (client_is_x11(c))
+		return c->surface.xwayland->pid;
+#endif
+	wl_client_get_credentials(wl_resource_get_client(c->surface.xdg->resource),
+			&pid, NULL, NULL);
+	return pid;
+}
+
 static inline const char *
 client_get_title(Client *c)
 {
@@ -133,9 +146,11 @@ client_set_size(Client *c, uint32_t width, uint32_t height)
 {
 #ifdef XWAYLAND
 	if (client_is_x11(c)) {
+		/* nonzero only for clients supporting _NET_WM_SYNC_REQUEST */
+		uint32_t serial = sendsyncrequest(c, width, height);
 		wlr_xwayland_surface_configure(c->surface.xwayland,
-				c->geom.x, c->geom.y, width, height);
-		return 0;
+				c->st->geom.x, c->st->geom.y, width, height);
+		return serial;
 	}
 #endif
 	return wlr_xdg_toplevel_set_size(c->surface.xdg, width, height);
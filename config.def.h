@@ -5,9 +5,44 @@ static const float rootcolor[]      = {0.3, 0.3, 0.3, 1.0};
 static const float bordercolor[]    = {0.5, 0.5, 0.5, 1.0};
 static const float focuscolor[]     = {1.0, 0.0, 0.0, 1.0};
 
+/* Run the compositor under SCHED_RR with this priority (1-99, 0 disables);
+ * needs CAP_SYS_NICE or an RLIMIT_RTPRIO allowance.  Spawned programs run
+ * under the normal policy. */
+static const int rtpriority = 0;
+/* Pre-fault this much heap at startup and lock the memory dwl has mapped
+ * by then; client buffers mapped later are not locked */
+static const int lockmemory = 0;
+static const size_t prefaultheap = 16 << 20;
+/* CPU lists like "0-1,4" to pin the compositor and the programs it starts
+ * to; NULL leaves dwl's affinity alone and starts programs on the CPUs dwl
+ * itself started with */
+static const char *compositorcpus = NULL;
+static const char *clientcpus     = NULL;
+/* cgroup v2 directory that spawned programs are moved into (created if
+ * needed) and its cpu.weight/io.weight (1-10000, 0 keeps the default) */
+static const char *clientcgroup   = NULL;
+static const int clientcpuweight  = 0;
+static const int clientioweight   = 0;
+/* Seconds of handler spans written out on SIGUSR2 or the "trace" command */
+static const int tracewindow = 10;
+/* Log event loop iterations longer than this many milliseconds along with
+ * the slowest listener or event source in them; 0 disables */
+static const int stallms = 16;
+/* Start XWayland when the first X11 client connects (XWaylandLazy), at
+ * startup (XWaylandEager), or xwaylandidle milliseconds after startup
+ * (XWaylandIdle).  The eager modes also bring it back right after a crash;
+ * the "metrics" command reports how long starts and restarts took. */
+static const int xwaylandmode = XWaylandLazy;
+static const int xwaylandidle = 2000;
+/* Milliseconds to hold frames for an X11 client that redraws in step with
+ * resizes (_NET_WM_SYNC_REQUEST) before giving up on it */
+static const int synctimeout = 100;
+
 /* tagging */
 static const char *tags[] = { "1", "2", "3", "4", "5", "6", "7", "8", "9" };
 
+/* app_id and title match as substrings; a leading ^ or trailing $ anchors
+ * them to the start or end.  Rules are checked again when a title changes. */
 static const Rule rules[] = {
 	/* app_id     title       tags mask     isfloating   monitor */
 	/* examples:
@@ -26,7 +61,8 @@ static const Layout layouts[] = {
 
 /* monitors
  * The order in which monitors are defined determines their position.
- * Non-configured monitors are always added to the left. */
+ * Non-configured monitors are always added to the left.  Names match like
+ * rules; the first matching entry is used. */
 static const MonitorRule monrules[] = {
 	/* name       mfact nmaster scale layout       rotate/reflect x y */
 	/* example of a HiDPI laptop monitor:
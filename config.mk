@@ -5,4 +5,8 @@ PREFIX = /usr/local
 CFLAGS ?= -g -Wall -Wextra -Werror -Wno-unused-parameter -Wno-sign-compare -Wno-unused-function -Wno-unused-variable -Wdeclaration-after-statement
 
 # Uncomment to build XWayland support
-#CFLAGS += -DXWAYLAND
+#CFLAGS += -DXWAYLAND $(shell pkg-config --cflags xcb-sync)
+#LDLIBS += $(shell pkg-config --libs xcb-sync)
+
+# Uncomment to build SystemTap/USDT probes (needs sys/sdt.h)
+#CFLAGS += -DUSDT
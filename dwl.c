@@ -1,18 +1,32 @@
 /*
  * See LICENSE file for copyright and license details.
  */
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <linux/input-event-codes.h>
+#include <linux/sched.h>
+#include <malloc.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <libinput.h>
 #include <wayland-server-core.h>
 #include <wlr/backend.h>
+#include <wlr/backend/headless.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/types/wlr_compositor.h>
 #include <wlr/types/wlr_cursor.h>
@@ -42,9 +56,14 @@
 #include <wlr/backend/libinput.h>
 #include <wlr/util/log.h>
 #include <xkbcommon/xkbcommon.h>
+#ifdef USDT
+#include <sys/sdt.h>
+#endif
 #ifdef XWAYLAND
 #include <X11/Xlib.h>
 #include <wlr/xwayland.h>
+#include <xcb/sync.h>
+#include <xcb/xcbext.h>
 #endif
 
 /* macros */
@@ -53,18 +72,56 @@
 #define MAX(A, B)               ((A) > (B) ? (A) : (B))
 #define MIN(A, B)               ((A) < (B) ? (A) : (B))
 #define CLEANMASK(mask)         (mask & ~WLR_MODIFIER_CAPS)
-#define VISIBLEON(C, M)         ((C)->mon == (M) && ((C)->tags & (M)->tagset[(M)->seltags]))
+#define VISIBLEON(C, M)         ISVISIBLE((C)->st, M)
+#define ISVISIBLE(S, M)         ((S)->mon == (M) && ((S)->tags & (M)->tagset[(M)->seltags]))
 #define LENGTH(X)               (sizeof X / sizeof X[0])
 #define END(A)                  ((A) + LENGTH(A))
+#define ULBITS                  (8 * sizeof(unsigned long))
+#define BITWORDS(N)             ((N) / ULBITS + 1)
 #define TAGMASK                 ((1 << LENGTH(tags)) - 1)
 #define ROUND(X)                ((int)((X)+0.5))
-#define LISTEN(E, L, H)         wl_signal_add((E), ((L)->notify = (H), (L)))
+#define LISTEN(E, L, H)         wl_signal_add((E), ((L)->notify = H##traced, (L)))
+#ifdef USDT
+#define PROBE(...)              STAP_PROBEV(dwl, __VA_ARGS__)
+#else
+#define PROBE(...)
+#endif
+#define TRACED(H)               static Handler H##handler = {.name = #H}; \
+                                static void H##traced(struct wl_listener *l, void *d) \
+                                { uint64_t t = nowns(); H(l, d); handlerdone(&H##handler, t); }
+#define TRACEDFD(H)             static Handler H##handler = {.name = #H}; \
+                                static int H##traced(int fd, uint32_t m, void *d) \
+                                { uint64_t t = nowns(); int r = H(fd, m, d); handlerdone(&H##handler, t); return r; }
+#define TRACEDSIGNAL(H)         static Handler H##handler = {.name = #H}; \
+                                static int H##traced(int s, void *d) \
+                                { uint64_t t = nowns(); int r = H(s, d); handlerdone(&H##handler, t); return r; }
+#define TRACEDTIMER(H)          static Handler H##handler = {.name = #H}; \
+                                static int H##traced(void *d) \
+                                { uint64_t t = nowns(); int r = H(d); handlerdone(&H##handler, t); return r; }
+#define TRACEDIDLE(H)           static Handler H##handler = {.name = #H}; \
+                                static void H##traced(void *d) \
+                                { uint64_t t = nowns(); H(d); handlerdone(&H##handler, t); }
+#define HISTLEN                 108
+#define LAUNCHLEN               32
+#define POOLSLAB                32  /* objects allocated at a time */
+#define POOLALIGN               16  /* slab header, keeps objects aligned */
+#define STATEMONS               8   /* monitors described in the state page */
+#define IPCINLEN                4096
+#define IPCOUTLEN               65536 /* queued events before they are dropped */
+#define IPCOUTMAX               (4 << 20) /* largest queued reply */
+#define TRACELEN                32768 /* handler spans kept for dumps */
+#define LATENCYMAX              250   /* ms before a latency sample is dropped */
 
 /* enums */
 enum { CurNormal, CurMove, CurResize }; /* cursor */
+enum { ArgNone, ArgInt, ArgTags, ArgFloat, ArgLayout, ArgDir, ArgCmd }; /* IPC */
+enum { RecKey, RecButton, RecMotion, RecMotionAbsolute, RecAxis, RecMap, RecUnmap,
+	RecCommit, RecFullscreen, RecLast }; /* record types */
+enum { XWaylandLazy, XWaylandEager, XWaylandIdle }; /* xwaylandmode */
 #ifdef XWAYLAND
 enum { NetWMWindowTypeDialog, NetWMWindowTypeSplash, NetWMWindowTypeToolbar,
-	NetWMWindowTypeUtility, NetLast }; /* EWMH atoms */
+	NetWMWindowTypeUtility, NetWMSyncRequest, NetWMSyncRequestCounter,
+	WMProtocols, NetLast }; /* EWMH and ICCCM atoms */
 enum { XDGShell, X11Managed, X11Unmanaged }; /* client types */
 #endif
 
@@ -82,11 +139,50 @@ typedef struct {
 	const Arg arg;
 } Button;
 
+/* Latency histogram in microseconds: four sub-buckets per power of two */
+typedef struct {
+	uint32_t b[HISTLEN];
+	uint64_t n, sum, max;
+} Hist;
+
+/* Configure statistics, aggregated by app_id */
+typedef struct AppStats AppStats;
+struct AppStats {
+	AppStats *next;
+	char *appid;
+	unsigned long sent;      /* configures scheduled */
+	unsigned long coalesced; /* size changes merged into a pending configure */
+	unsigned long commits;
+	Hist ack;                /* configure to ack_configure */
+	Hist commit;             /* ack_configure to the completing commit */
+};
+
 typedef struct Monitor Monitor;
+typedef struct Client Client;
+
+/* Per-client state read by the scans in tile(), xytoclient(), focustop(),
+ * renderclients() and rendermon().  It lives in one dense array so those
+ * walk memory linearly; Client::st points at the entry and is kept up to
+ * date by registerclient() and unregisterclient(). */
 typedef struct {
+	struct wlr_box geom;  /* layout-relative, includes border */
+	Monitor *mon;
+	unsigned int tags;
+	int bw;
+	int isfloating;
+	int isfullscreen;
+	uint32_t resize; /* configure serial of a pending resize */
+	unsigned int focusseq; /* last move to the head of fstack */
+	unsigned int stackseq; /* last move to the head of stack */
+	Client *c;
+} ClientState;
+
+struct Client {
+	/* the lists only keep ordering; scans use ClientState */
 	struct wl_list link;
 	struct wl_list flink;
 	struct wl_list slink;
+	ClientState *st;
 	union {
 		struct wlr_xdg_surface *xdg;
 		struct wlr_xwayland_surface *xwayland;
@@ -96,23 +192,31 @@ typedef struct {
 	struct wl_listener unmap;
 	struct wl_listener destroy;
 	struct wl_listener fullscreen;
-	struct wlr_box geom;  /* layout-relative, includes border */
-	Monitor *mon;
+	struct wl_listener ackconfigure;
+	struct wl_listener settitle;
+	struct wl_listener setappid;
 #ifdef XWAYLAND
 	unsigned int type;
 	struct wl_listener activate;
 	struct wl_listener configure;
+	struct wl_listener setgeometry;
+	struct wl_list configlink;    /* configqueue */
+	struct wlr_box configurereq;  /* latest request_configure */
+	unsigned int indepseq; /* map order of an independent */
+	unsigned int synccookie; /* pending _NET_WM_SYNC_REQUEST_COUNTER read */
+	uint32_t syncalarm;      /* fires when the client redrew, see xcbready() */
+	uint64_t syncvalue;      /* last _NET_WM_SYNC_REQUEST value sent */
 #endif
-	int bw;
-	unsigned int tags;
-	int isfloating;
-	uint32_t resize; /* configure serial of a pending resize */
+	uint64_t configuretime, acktime; /* of the pending resize */
+	uint32_t id;          /* in the -R log */
+	AppStats *app;        /* cached appstats(), reset on app_id changes */
+	unsigned long *matched; /* bitset of the rules[] c matched, see evalrules() */
+	int commitwidth, commitheight;
 	int prevx;
 	int prevy;
 	int prevwidth;
 	int prevheight;
-	int isfullscreen;
-} Client;
+};
 
 typedef struct {
 	struct wl_listener request_mode;
@@ -161,10 +265,18 @@ typedef struct {
 	void (*arrange)(Monitor *);
 } Layout;
 
+#ifdef XWAYLAND
+typedef struct {
+	struct wlr_box geom;
+	Client *c;
+} Independent;
+#endif
+
 struct Monitor {
 	struct wl_list link;
 	struct wlr_output *wlr_output;
 	struct wl_listener frame;
+	struct wl_listener present;
 	struct wl_listener destroy;
 	struct wlr_box m;      /* monitor area, layout-relative */
 	struct wlr_box w;      /* window area, layout-relative */
@@ -176,8 +288,100 @@ struct Monitor {
 	double mfact;
 	int nmaster;
 	Client *fullscreenclient;
+	int arrangepending;    /* arrange() was called during a batch */
+	unsigned long frames, skipped;
+	int firstframe;    /* a frame has been committed */
+	uint64_t latinput; /* input time of a sample awaiting presentation */
+	int latframe;      /* latinput was committed in the last frame */
+	Hist latency;      /* input-to-photon, microseconds */
+#ifdef XWAYLAND
+	Independent *indep; /* independents overlapping m, bottom to top */
+	size_t nindep, indepcap;
+#endif
+};
+
+/* Free-list allocator for one object type */
+typedef struct {
+	const char *name;
+	size_t size;
+	void *freelist; /* next free object is stored in its first word */
+	void *slabs;    /* likewise, chained through the slab header */
+	unsigned long allocs, live, peak, nslabs;
+} Pool;
+
+typedef struct {
+	const char *name;
+	void (*func)(const Arg *);
+	int argtype;
+} IpcCommand;
+
+typedef struct {
+	void (*func)(const Arg *);
+	Arg arg;
+} Command;
+
+typedef struct {
+	const char *name;
+	uint64_t start, end; /* nowns() */
+} Span;
+
+/* One entry of a -R log, after a header of "dwlrec1" and the width and
+ * height of the first output as two uint32_t.  Host byte order. */
+typedef struct {
+	uint32_t msec; /* since recording started */
+	uint16_t type;
+	uint16_t a;    /* key/button state, axis orientation | source << 8 */
+	uint32_t b;    /* keycode, button, axis discrete delta, client id */
+	float x, y;    /* motion delta or position, axis delta, client size */
+} Record;
+
+/* Statistics of one listener or event source, kept by its TRACED*() trampoline */
+typedef struct Handler Handler;
+struct Handler {
+	const char *name;
+	Handler *next; /* in handlers, once it has run */
+	unsigned long calls;
+	uint64_t ns, maxns;
 };
 
+/* A connection to the control socket */
+typedef struct {
+	struct wl_list link;
+	int fd;
+	struct wl_event_source *source;
+	int subscribed;
+	int eof;               /* peer shut down its side, only write */
+	unsigned long dropped; /* events lost since the last "dropped" line */
+	Command *batch;        /* commands waiting for the end of the batch */
+	size_t nbatch, batchcap;
+	int batcherror;
+	size_t inlen;
+	size_t outhead, outlen, outcap; /* ring of output not yet written */
+	char in[IPCINLEN];
+	char *out;
+} IpcClient;
+
+/* Layout of the page published through $DWL_STATE.  Readers map it
+ * read-only, copy it out and retry if seq was odd or has changed in the
+ * meantime; FUTEX_WAIT on seq sleeps until the next update.  Strings are
+ * NUL-terminated and truncated to fit. */
+typedef struct {
+	uint32_t seq;      /* odd while an update is in progress */
+	uint32_t nmons;
+	struct {
+		char name[32];
+		uint32_t tags;     /* tagset[seltags] */
+		uint32_t occupied; /* tags holding at least one client */
+		uint32_t urgent;   /* always 0, dwl does not track urgency */
+		uint32_t selected; /* this is selmon */
+		int32_t nmaster;
+		double mfact;
+		char ltsymbol[16];
+	} mons[STATEMONS];
+	char title[256];   /* of the focused client */
+	char appid[128];
+} StatePage;
+
 typedef struct {
 	const char *name;
 	float mfact;
@@ -197,6 +401,31 @@ typedef struct {
 	int monitor;
 } Rule;
 
+/* Aho-Corasick automaton over rule patterns, see matcherbuild() */
+typedef struct {
+	int child, sibling;   /* trie edges */
+	int fail;             /* longest proper suffix that is in the trie */
+	int out;              /* nearest node on the fail chain ending a pattern */
+	int pats;             /* patterns ending here, index into Matcher::pats */
+	unsigned int depth;
+	unsigned char ch;
+} MatchNode;
+
+typedef struct {
+	unsigned int id;
+	int start, end;       /* anchored with ^ and $ */
+	int next;
+} MatchPat;
+
+typedef struct {
+	MatchNode *nodes;
+	size_t nnodes, nodecap;
+	MatchPat *pats;
+	size_t npats, patcap;
+	unsigned long *always; /* ids added with a NULL pattern */
+	size_t words;
+} Matcher;
+
 /* Used to move all of the data necessary to render a surface from the top-level
  * frame handler to the per-surface render function. */
 struct render_data {
@@ -206,6 +435,8 @@ struct render_data {
 };
 
 /* function declarations */
+static void ackconfigurenotify(struct wl_listener *listener, void *data);
+static AppStats *appstats(Client *c);
 static void applybounds(Client *c, struct wlr_box *bbox);
 static void applyexclusive(struct wlr_box *usable_area, uint32_t anchor,
 		int32_t exclusive, int32_t margin_top, int32_t margin_right,
@@ -224,6 +455,7 @@ static void cleanupmon(struct wl_listener *listener, void *data);
 static void closemon(Monitor *m);
 static void commitlayersurfacenotify(struct wl_listener *listener, void *data);
 static void commitnotify(struct wl_listener *listener, void *data);
+static void compilerules(void);
 static void createkeyboard(struct wlr_input_device *device);
 static void createmon(struct wl_listener *listener, void *data);
 static void createnotify(struct wl_listener *listener, void *data);
@@ -235,70 +467,170 @@ static void destroylayersurfacenotify(struct wl_listener *listener, void *data);
 static void destroynotify(struct wl_listener *listener, void *data);
 static void destroyxdeco(struct wl_listener *listener, void *data);
 static Monitor *dirtomon(enum wlr_direction dir);
+static Monitor *evalrules(Client *c, unsigned int *newtags);
 static void focusclient(Client *c, int lift);
 static void focusmon(const Arg *arg);
 static void focusstack(const Arg *arg);
 static void fullscreennotify(struct wl_listener *listener, void *data);
 static Client *focustop(Monitor *m);
 static void getxdecomode(struct wl_listener *listener, void *data);
+static void handlerdone(Handler *h, uint64_t start);
+static void histadd(Hist *h, uint64_t us);
+static uint64_t histpct(Hist *h, double p);
 static void incnmaster(const Arg *arg);
 static void inputdevice(struct wl_listener *listener, void *data);
+static void inputhandled(uint32_t time);
+static int ipcaccept(int fd, uint32_t mask, void *data);
+static void ipcclientevent(const char *name, Client *c);
+static void ipcclose(IpcClient *ic);
+static void ipccommand(IpcClient *ic, char *line);
+static int ipcdispatch(int fd, uint32_t mask, void *data);
+static void ipcendbatch(IpcClient *ic);
+static void ipcevent(const char *fmt, ...);
+static int ipcflush(IpcClient *ic);
+static void ipcmetrics(IpcClient *ic);
+static int ipcprintf(IpcClient *ic, const char *fmt, ...);
+static void ipcupdate(IpcClient *ic);
+static int ipcwrite(IpcClient *ic, const char *buf, size_t len, size_t max);
 static int keybinding(uint32_t mods, xkb_keysym_t sym);
 static void keypress(struct wl_listener *listener, void *data);
 static void keypressmod(struct wl_listener *listener, void *data);
 static void killclient(const Arg *arg);
+static pid_t launch(char *const argv[], int newsession);
+static int launchedby(pid_t pid);
+static void loadcursors(void *data);
+static void loopdone(void *data);
 static void maplayersurfacenotify(struct wl_listener *listener, void *data);
 static void mapnotify(struct wl_listener *listener, void *data);
+static void matcheradd(Matcher *mt, const char *pat, unsigned int id);
+static void matcherbuild(Matcher *mt);
+static void matcherrun(const Matcher *mt, const char *text, unsigned long *set);
+static int matchnext(const Matcher *mt, int node, unsigned char ch);
+static int matchnode(Matcher *mt, int parent, unsigned char ch);
 static void maximizeclient(Client *c);
 static void monocle(Monitor *m);
 static void motionabsolute(struct wl_listener *listener, void *data);
 static void motionnotify(uint32_t time);
 static void motionrelative(struct wl_listener *listener, void *data);
 static void moveresize(const Arg *arg);
+static uint64_t nowns(void);
 static void outputmgrapply(struct wl_listener *listener, void *data);
 static void outputmgrapplyortest(struct wlr_output_configuration_v1 *config, int test);
 static void outputmgrtest(struct wl_listener *listener, void *data);
+static void parsecpus(const char *list, cpu_set_t *set);
+static void placeclient(Client *c);
 static void pointerfocus(Client *c, struct wlr_surface *surface,
 		double sx, double sy, uint32_t time);
+static void *poolalloc(Pool *p);
+static void poolfree(Pool *p, void *obj);
+static void presentmon(struct wl_listener *listener, void *data);
+static const char *promescape(const char *s);
+static void promsummary(FILE *out, const char *name, const char *labels, Hist *h);
+static void publishstate(void *data);
 static void quit(const Arg *arg);
+static int reapchildren(int signo, void *data);
+static void reapplyrules(Client *c, const unsigned long *match);
+static void record(int type, unsigned int a, uint32_t b, float x, float y);
+static void registerclient(Client *c);
 static void render(struct wlr_surface *surface, int sx, int sy, void *data);
 static void renderclients(Monitor *m, struct timespec *now);
 static void renderlayer(struct wl_list *layer_surfaces, struct timespec *now);
 static void rendermon(struct wl_listener *listener, void *data);
+static void replay(const Record *r);
+static int replaynext(void *data);
 static void resize(Client *c, int x, int y, int w, int h, int interact);
-static void run(char *startup_cmd);
+static void rulematch(Client *c, unsigned long *match);
+static void run(char *startup_cmd, char *recordpath);
 static void scalebox(struct wlr_box *box, float scale);
 static Client *selclient(void);
 static void setcursor(struct wl_listener *listener, void *data);
 static void setpsel(struct wl_listener *listener, void *data);
+static void setrealtime(void);
 static void setsel(struct wl_listener *listener, void *data);
 static void setfloating(Client *c, int floating);
 static void setfullscreen(Client *c, int fullscreen);
 static void setlayout(const Arg *arg);
 static void setmfact(const Arg *arg);
 static void setmon(Client *c, Monitor *m, unsigned int newtags);
+static void setplacement(void);
 static void setup(void);
-static void sigchld(int unused);
+static void setupipc(const char *display);
+static void setupstate(void);
 static void spawn(const Arg *arg);
+static int stackcmp(const void *a, const void *b);
+static void startupmark(const char *fmt, ...);
+static void statechanged(void);
 static void tag(const Arg *arg);
 static void tagmon(const Arg *arg);
 static void tile(Monitor *m);
 static void togglefloating(const Arg *arg);
 static void togglefullscreen(const Arg *arg);
 static void toggletag(const Arg *arg);
+static int tracesignal(int signo, void *data);
+static uint64_t tracespan(const char *name, uint64_t start);
 static void toggleview(const Arg *arg);
 static void unmaplayersurface(LayerSurface *layersurface);
+static void unregisterclient(Client *c);
 static void unmaplayersurfacenotify(struct wl_listener *listener, void *data);
 static void unmapnotify(struct wl_listener *listener, void *data);
+static void updateappid(struct wl_listener *listener, void *data);
 static void updatemons(struct wl_listener *listener, void *data);
+static void updatetitle(struct wl_listener *listener, void *data);
 static void view(const Arg *arg);
 static void virtualkeyboard(struct wl_listener *listener, void *data);
 static Client *xytoclient(double x, double y);
 static struct wlr_surface *xytolayersurface(struct wl_list *layer_surfaces,
 		double x, double y, double *sx, double *sy);
 static Monitor *xytomon(double x, double y);
+static int writetrace(char *path, size_t size);
 static void zoom(const Arg *arg);
 
+/* every handler connected with LISTEN or below is timed through these */
+TRACED(ackconfigurenotify)
+TRACED(axisnotify)
+TRACED(buttonpress)
+TRACED(cleanupkeyboard)
+TRACED(cleanupmon)
+TRACED(commitlayersurfacenotify)
+TRACED(commitnotify)
+TRACED(createlayersurface)
+TRACED(createmon)
+TRACED(createnotify)
+TRACED(createxdeco)
+TRACED(cursorframe)
+TRACED(destroylayersurfacenotify)
+TRACED(destroynotify)
+TRACED(destroyxdeco)
+TRACED(fullscreennotify)
+TRACED(getxdecomode)
+TRACED(inputdevice)
+TRACED(keypress)
+TRACED(keypressmod)
+TRACED(maplayersurfacenotify)
+TRACED(mapnotify)
+TRACED(motionabsolute)
+TRACED(motionrelative)
+TRACED(outputmgrapply)
+TRACED(outputmgrtest)
+TRACED(presentmon)
+TRACED(rendermon)
+TRACED(setcursor)
+TRACED(setpsel)
+TRACED(setsel)
+TRACED(unmaplayersurfacenotify)
+TRACED(unmapnotify)
+TRACED(updateappid)
+TRACED(updatemons)
+TRACED(updatetitle)
+TRACED(virtualkeyboard)
+TRACEDFD(ipcaccept)
+TRACEDFD(ipcdispatch)
+TRACEDIDLE(loadcursors)
+TRACEDIDLE(publishstate)
+TRACEDSIGNAL(reapchildren)
+TRACEDTIMER(replaynext)
+TRACEDSIGNAL(tracesignal)
+
 /* variables */
 static const char broken[] = "broken";
 static struct wl_display *dpy;
@@ -311,6 +643,11 @@ static struct wl_list clients; /* tiling order */
 static struct wl_list fstack;  /* focus order */
 static struct wl_list stack;   /* stacking z-order */
 static struct wl_list independents;
+static ClientState *cstate;   /* dense, in no particular order */
+static ClientState **cdrawn;  /* scratch for renderclients() */
+static size_t ncstate, cstatecap;
+static unsigned int seqclock; /* source of focusseq and stackseq */
+static AppStats *apps;
 static struct wlr_idle *idle;
 static struct wlr_layer_shell_v1 *layer_shell;
 static struct wlr_xdg_decoration_manager_v1 *xdeco_mgr;
@@ -319,15 +656,13 @@ static struct wlr_virtual_keyboard_manager_v1 *virtual_keyboard_mgr;
 
 static struct wlr_cursor *cursor;
 static struct wlr_xcursor_manager *cursor_mgr;
-#ifdef XWAYLAND
-static struct wlr_xcursor *xcursor;
-static struct wlr_xcursor_manager *xcursor_mgr;
-#endif
+static int cursorsloaded; /* themes are loaded after the first frame */
 
 static struct wlr_seat *seat;
 static struct wl_list keyboards;
 static unsigned int cursor_mode;
 static Client *grabc;
+static Client *placing; /* resize() only configures this one, see placeclient() */
 static int grabcx, grabcy; /* client-relative */
 
 static struct wlr_output_layout *output_layout;
@@ -335,37 +670,146 @@ static struct wlr_box sgeom;
 static struct wl_list mons;
 static Monitor *selmon;
 
+/* how long input events waited for the main loop */
+static Hist inputdelay;
+static uint64_t latinput; /* input awaiting a commit from the focused client */
+
+/* recently launched programs, for launch-to-first-map times */
+static struct { pid_t pid; uint64_t time; } launches[LAUNCHLEN];
+static unsigned int nlaunches;
+static Hist launchmap;
+
+/* rules[] by app_id and title, and monrules[] by output name */
+static Matcher idmatcher, titlematcher, monmatcher;
+
+/* startup timeline, relative to entering main() */
+static uint64_t startuptime;
+
+/* counters for the "metrics" command */
+static unsigned long arranges, hittests, loopiterations;
+static uint64_t dispatchns;
+
+/* ring of recent handler and render spans, see writetrace() */
+static Span spans[TRACELEN];
+static uint64_t nspans;
+
+/* -R and -P: input and client actions, replayed on the headless backend */
+static FILE *recordfp, *replayfp;
+static uint64_t recordstart, replaystart;
+static uint32_t nextclientid;
+static unsigned long logcounts[RecLast], livecounts[RecLast];
+static struct wlr_input_device *replaykbd, *replayptr;
+static struct wl_event_source *replaytimer;
+static Record replayrec;
+static int replaypending;
+
+/* listeners that have run, and the longest one in this loop iteration */
+static Handler *handlers;
+static Handler *slowest;
+static uint64_t slowestns;
+static uint64_t loopstart; /* first handler of this iteration, see loopdone() */
+static unsigned long stalls;
+static uint64_t stalllogtime; /* stalls are logged at most once a second */
+static unsigned long stallsunlogged;
+
+/* object pools; short-lived popup and menu windows reuse warm memory */
+static Pool clientpool = {.name = "Client", .size = sizeof(Client)};
+static Pool decorationpool = {.name = "Decoration", .size = sizeof(Decoration)};
+static Pool keyboardpool = {.name = "Keyboard", .size = sizeof(Keyboard)};
+static Pool layersurfacepool = {.name = "LayerSurface", .size = sizeof(LayerSurface)};
+static Pool *pools[] = { &clientpool, &decorationpool, &keyboardpool,
+	&layersurfacepool };
+
+
+/* state page for bars, rewritten from an idle callback after changes */
+static StatePage *statepage;
+static struct wl_event_source *stateidle;
+
+/* control socket, $DWL_SOCK */
+static int ipcfd = -1;
+static struct sockaddr_un ipcaddr;
+static struct wl_event_source *ipcsource;
+static struct wl_list ipcclients;
+static int batching;         /* arrange and seat focus wait for the end */
+static int focuspending;
+static Client *batchfocus;
+
+/* CPU and cgroup placement of the compositor and launched programs */
+static cpu_set_t compositormask, clientmask;
+static int cgroupfd = -1;
+
 /* global event handlers */
-static struct wl_listener cursor_axis = {.notify = axisnotify};
-static struct wl_listener cursor_button = {.notify = buttonpress};
-static struct wl_listener cursor_frame = {.notify = cursorframe};
-static struct wl_listener cursor_motion = {.notify = motionrelative};
-static struct wl_listener cursor_motion_absolute = {.notify = motionabsolute};
-static struct wl_listener layout_change = {.notify = updatemons};
-static struct wl_listener new_input = {.notify = inputdevice};
-static struct wl_listener new_virtual_keyboard = {.notify = virtualkeyboard};
-static struct wl_listener new_output = {.notify = createmon};
-static struct wl_listener new_xdeco = {.notify = createxdeco};
-static struct wl_listener new_xdg_surface = {.notify = createnotify};
-static struct wl_listener new_layer_shell_surface = {.notify = createlayersurface};
-static struct wl_listener output_mgr_apply = {.notify = outputmgrapply};
-static struct wl_listener output_mgr_test = {.notify = outputmgrtest};
-static struct wl_listener request_cursor = {.notify = setcursor};
-static struct wl_listener request_set_psel = {.notify = setpsel};
-static struct wl_listener request_set_sel = {.notify = setsel};
+static struct wl_listener cursor_axis = {.notify = axisnotifytraced};
+static struct wl_listener cursor_button = {.notify = buttonpresstraced};
+static struct wl_listener cursor_frame = {.notify = cursorframetraced};
+static struct wl_listener cursor_motion = {.notify = motionrelativetraced};
+static struct wl_listener cursor_motion_absolute = {.notify = motionabsolutetraced};
+static struct wl_listener layout_change = {.notify = updatemonstraced};
+static struct wl_listener new_input = {.notify = inputdevicetraced};
+static struct wl_listener new_virtual_keyboard = {.notify = virtualkeyboardtraced};
+static struct wl_listener new_output = {.notify = createmontraced};
+static struct wl_listener new_xdeco = {.notify = createxdecotraced};
+static struct wl_listener new_xdg_surface = {.notify = createnotifytraced};
+static struct wl_listener new_layer_shell_surface = {.notify = createlayersurfacetraced};
+static struct wl_listener output_mgr_apply = {.notify = outputmgrapplytraced};
+static struct wl_listener output_mgr_test = {.notify = outputmgrtesttraced};
+static struct wl_listener request_cursor = {.notify = setcursortraced};
+static struct wl_listener request_set_psel = {.notify = setpseltraced};
+static struct wl_listener request_set_sel = {.notify = setseltraced};
 
 #ifdef XWAYLAND
 static void activatex11(struct wl_listener *listener, void *data);
+static void closexcb(void);
 static void configurex11(struct wl_listener *listener, void *data);
 static void createnotifyx11(struct wl_listener *listener, void *data);
-static Atom getatom(xcb_connection_t *xc, const char *name);
-static void renderindependents(struct wlr_output *output, struct timespec *now);
+static void fetchsynccounter(Client *c);
+static void flushconfigures(void *data);
+static void placeindependent(Client *c, int mapped);
+static void renderindependents(Monitor *m, struct timespec *now);
+static uint32_t sendsyncrequest(Client *c, uint32_t width, uint32_t height);
+static void setgeometryx11(struct wl_listener *listener, void *data);
+static int wakexwayland(void *data);
+static int xcbready(int fd, uint32_t mask, void *data);
 static void xwaylandready(struct wl_listener *listener, void *data);
 static Client *xytoindependent(double x, double y);
-static struct wl_listener new_xwayland_surface = {.notify = createnotifyx11};
-static struct wl_listener xwayland_ready = {.notify = xwaylandready};
+TRACED(activatex11)
+TRACED(configurex11)
+TRACED(createnotifyx11)
+TRACED(setgeometryx11)
+TRACED(xwaylandready)
+TRACEDIDLE(flushconfigures)
+TRACEDTIMER(wakexwayland)
+TRACEDFD(xcbready)
+static struct wl_listener new_xwayland_surface = {.notify = createnotifyx11traced};
+static struct wl_listener xwayland_ready = {.notify = xwaylandreadytraced};
 static struct wlr_xwayland *xwayland;
 static Atom netatom[NetLast];
+static const char *netatomnames[NetLast] = {
+	[NetWMWindowTypeDialog] = "_NET_WM_WINDOW_TYPE_DIALOG",
+	[NetWMWindowTypeSplash] = "_NET_WM_WINDOW_TYPE_SPLASH",
+	[NetWMWindowTypeToolbar] = "_NET_WM_WINDOW_TYPE_TOOLBAR",
+	[NetWMWindowTypeUtility] = "_NET_WM_WINDOW_TYPE_UTILITY",
+	[NetWMSyncRequest] = "_NET_WM_SYNC_REQUEST",
+	[NetWMSyncRequestCounter] = "_NET_WM_SYNC_REQUEST_COUNTER",
+	[WMProtocols] = "WM_PROTOCOLS",
+};
+/* connection to XWayland, read from the event loop and never waited on */
+static xcb_connection_t *xc;
+static struct wl_event_source *xcbsource;
+static unsigned int atomseq[NetLast]; /* outstanding InternAtom requests */
+static int syncevent; /* first SYNC event, -1 without the extension */
+static unsigned long synctimeouts;
+/* X server (re)starts we asked for, and how long they took to be ready */
+static struct wl_event_source *xwaylandtimer;
+static uint64_t xwaylandspawn;
+static int xwaylandcrashed;
+static unsigned long xwaylandstarts, xwaylandrestarts;
+static uint64_t xwaylandstartns[2]; /* first start, last restart */
+static unsigned int indepclock;
+/* clients with a request_configure to answer, see flushconfigures() */
+static struct wl_list configqueue;
+static struct wl_event_source *configidle;
+static unsigned long configrequests, configsent;
 #endif
 
 /* configuration, allows nested code to access above variables */
@@ -377,22 +821,69 @@ static Atom netatom[NetLast];
 /* compile-time check if all tags fit into an unsigned int bit array. */
 struct NumTags { char limitexceeded[LENGTH(tags) > 31 ? -1 : 1]; };
 
+/* commands accepted on the control socket */
+static const IpcCommand ipccommands[] = {
+	{ "focusmon",   focusmon,   ArgDir },
+	{ "incnmaster", incnmaster, ArgInt },
+	{ "killclient", killclient, ArgNone },
+	{ "setlayout",  setlayout,  ArgLayout },
+	{ "setmfact",   setmfact,   ArgFloat },
+	{ "spawn",      spawn,      ArgCmd },
+	{ "tag",        tag,        ArgTags },
+	{ "tagmon",     tagmon,     ArgDir },
+	{ "toggleview", toggleview, ArgTags },
+	{ "view",       view,       ArgTags },
+	{ "zoom",       zoom,       ArgNone },
+};
+
 /* function implementations */
+void
+ackconfigurenotify(struct wl_listener *listener, void *data)
+{
+	Client *c = wl_container_of(listener, c, ackconfigure);
+	struct wlr_xdg_surface_configure *configure = data;
+
+	if (!c->st->resize || configure->serial != c->st->resize)
+		return;
+	c->acktime = nowns();
+	histadd(&appstats(c)->ack, (c->acktime - c->configuretime) / 1000);
+}
+
+AppStats *
+appstats(Client *c)
+{
+	/* Looked up once per app_id and cached, see updateappid() */
+	const char *appid;
+	AppStats *a;
+
+	if (c->app)
+		return c->app;
+	if (!(appid = client_get_appid(c)))
+		appid = broken;
+	for (a = apps; a; a = a->next)
+		if (!strcmp(a->appid, appid))
+			return c->app = a;
+	if (!(a = calloc(1, sizeof(*a))) || !(a->appid = strdup(appid)))
+		EBARF("appstats: alloc");
+	a->next = apps;
+	return c->app = apps = a;
+}
+
 void
 applybounds(Client *c, struct wlr_box *bbox)
 {
 	/* set minimum possible */
-	c->geom.width = MAX(1, c->geom.width);
-	c->geom.height = MAX(1, c->geom.height);
-
-	if (c->geom.x >= bbox->x + bbox->width)
-		c->geom.x = bbox->x + bbox->width - c->geom.width;
-	if (c->geom.y >= bbox->y + bbox->height)
-		c->geom.y = bbox->y + bbox->height - c->geom.height;
-	if (c->geom.x + c->geom.width + 2 * c->bw <= bbox->x)
-		c->geom.x = bbox->x;
-	if (c->geom.y + c->geom.height + 2 * c->bw <= bbox->y)
-		c->geom.y = bbox->y;
+	c->st->geom.width = MAX(1, c->st->geom.width);
+	c->st->geom.height = MAX(1, c->st->geom.height);
+
+	if (c->st->geom.x >= bbox->x + bbox->width)
+		c->st->geom.x = bbox->x + bbox->width - c->st->geom.width;
+	if (c->st->geom.y >= bbox->y + bbox->height)
+		c->st->geom.y = bbox->y + bbox->height - c->st->geom.height;
+	if (c->st->geom.x + c->st->geom.width + 2 * c->st->bw <= bbox->x)
+		c->st->geom.x = bbox->x;
+	if (c->st->geom.y + c->st->geom.height + 2 * c->st->bw <= bbox->y)
+		c->st->geom.y = bbox->y;
 }
 
 void
@@ -453,39 +944,28 @@ applyexclusive(struct wlr_box *usable_area,
 void
 applyrules(Client *c)
 {
-	/* rule matching */
-	const char *appid, *title;
-	unsigned int i, newtags = 0;
-	const Rule *r;
-	Monitor *mon = selmon, *m;
-
-	c->isfloating = client_is_float_type(c);
-	if (!(appid = client_get_appid(c)))
-		appid = broken;
-	if (!(title = client_get_title(c)))
-		title = broken;
+	unsigned int newtags;
+	Monitor *mon = evalrules(c, &newtags);
 
-	for (r = rules; r < END(rules); r++) {
-		if ((!r->title || strstr(title, r->title))
-				&& (!r->id || strstr(appid, r->id))) {
-			c->isfloating = r->isfloating;
-			newtags |= r->tags;
-			i = 0;
-			wl_list_for_each(m, &mons, link)
-				if (r->monitor == i++)
-					mon = m;
-		}
-	}
 	setmon(c, mon, newtags);
 }
 
 void
 arrange(Monitor *m)
 {
+	if (batching) {
+		m->arrangepending = 1;
+		return;
+	}
+	PROBE(arrange_entry, m, m->tagset[m->seltags]);
+	m->arrangepending = 0;
+	arranges++;
 	if (m->lt[m->sellt]->arrange)
 		m->lt[m->sellt]->arrange(m);
 	else if (m->fullscreenclient)
 		maximizeclient(m->fullscreenclient);
+	statechanged();
+	PROBE(arrange_return, m);
 	/* TODO recheck pointer focus here... or in resize()? */
 }
 
@@ -624,6 +1104,9 @@ axisnotify(struct wl_listener *listener, void *data)
 	/* This event is forwarded by the cursor when a pointer emits an axis event,
 	 * for example when you move the scroll wheel. */
 	struct wlr_event_pointer_axis *event = data;
+	record(RecAxis, event->orientation | event->source << 8,
+			event->delta_discrete, 0, event->delta);
+	inputhandled(event->time_msec);
 	wlr_idle_notify_activity(idle, seat);
 	/* Notify the client with pointer focus of the axis event. */
 	wlr_seat_pointer_notify_axis(seat,
@@ -640,6 +1123,8 @@ buttonpress(struct wl_listener *listener, void *data)
 	Client *c;
 	const Button *b;
 
+	record(RecButton, event->state, event->button, 0, 0);
+	inputhandled(event->time_msec);
 	wlr_idle_notify_activity(idle, seat);
 
 	switch (event->state) {
@@ -687,10 +1172,49 @@ chvt(const Arg *arg)
 void
 cleanup(void)
 {
+	AppStats *a;
+	IpcClient *ic, *itmp;
+	void *slab;
+	size_t i;
+
+	while ((a = apps)) {
+		fprintf(stderr, "%s: %lu configures, %lu coalesced, ack p50 %lluus p99 %lluus, commit p50 %lluus p99 %lluus\n",
+				a->appid, a->sent, a->coalesced,
+				(unsigned long long)histpct(&a->ack, 0.5),
+				(unsigned long long)histpct(&a->ack, 0.99),
+				(unsigned long long)histpct(&a->commit, 0.5),
+				(unsigned long long)histpct(&a->commit, 0.99));
+		apps = a->next;
+		free(a->appid);
+		free(a);
+	}
+	if (launchmap.n)
+		fprintf(stderr, "launch to first map: p50 %lluus p99 %lluus max %lluus (%llu launches)\n",
+				(unsigned long long)histpct(&launchmap, 0.5),
+				(unsigned long long)histpct(&launchmap, 0.99),
+				(unsigned long long)launchmap.max,
+				(unsigned long long)launchmap.n);
+	if (inputdelay.n)
+		fprintf(stderr, "input queueing delay: p50 %lluus p99 %lluus max %lluus (%llu events)\n",
+				(unsigned long long)histpct(&inputdelay, 0.5),
+				(unsigned long long)histpct(&inputdelay, 0.99),
+				(unsigned long long)inputdelay.max,
+				(unsigned long long)inputdelay.n);
 #ifdef XWAYLAND
+	if (xc)
+		closexcb();
+	if (xwaylandtimer)
+		wl_event_source_remove(xwaylandtimer);
 	wlr_xwayland_destroy(xwayland);
 #endif
 	wl_display_destroy_clients(dpy);
+	wl_list_for_each_safe(ic, itmp, &ipcclients, link)
+		ipcclose(ic);
+	if (ipcfd >= 0) {
+		wl_event_source_remove(ipcsource);
+		close(ipcfd);
+		unlink(ipcaddr.sun_path);
+	}
 
 	wlr_backend_destroy(backend);
 	wlr_xcursor_manager_destroy(cursor_mgr);
@@ -698,6 +1222,21 @@ cleanup(void)
 	wlr_output_layout_destroy(output_layout);
 	wlr_seat_destroy(seat);
 	wl_display_destroy(dpy);
+	if (recordfp)
+		fclose(recordfp);
+	free(cstate);
+	free(cdrawn);
+
+	for (i = 0; i < LENGTH(pools); i++) {
+		if (pools[i]->live)
+			fprintf(stderr, "%lu %s objects leaked (%lu allocated, peak %lu)\n",
+					pools[i]->live, pools[i]->name,
+					pools[i]->allocs, pools[i]->peak);
+		while ((slab = pools[i]->slabs)) {
+			pools[i]->slabs = *(void **)slab;
+			free(slab);
+		}
+	}
 }
 
 void
@@ -710,7 +1249,7 @@ cleanupkeyboard(struct wl_listener *listener, void *data)
 	wl_list_remove(&kb->modifiers.link);
 	wl_list_remove(&kb->key.link);
 	wl_list_remove(&kb->destroy.link);
-	free(kb);
+	poolfree(&keyboardpool, kb);
 }
 
 void
@@ -720,10 +1259,21 @@ cleanupmon(struct wl_listener *listener, void *data)
 	Monitor *m = wlr_output->data;
 	int nmons, i = 0;
 
+	if (m->latency.n)
+		fprintf(stderr, "%s input-to-photon latency: p50 %lluus p90 %lluus p99 %lluus max %lluus (%llu samples)\n",
+				wlr_output->name,
+				(unsigned long long)histpct(&m->latency, 0.5),
+				(unsigned long long)histpct(&m->latency, 0.9),
+				(unsigned long long)histpct(&m->latency, 0.99),
+				(unsigned long long)m->latency.max,
+				(unsigned long long)m->latency.n);
+
 	wl_list_remove(&m->destroy.link);
+	wl_list_remove(&m->present.link);
 	wl_list_remove(&m->frame.link);
 	wl_list_remove(&m->link);
 	wlr_output_layout_remove(output_layout, m->wlr_output);
+	ipcevent("monitor\tremove\t%s", wlr_output->name);
 
 	nmons = wl_list_length(&mons);
 	do // don't switch to disabled mons
@@ -731,6 +1281,9 @@ cleanupmon(struct wl_listener *listener, void *data)
 	while (!selmon->wlr_output->enabled && i++ < nmons);
 	focusclient(focustop(selmon), 1);
 	closemon(m);
+#ifdef XWAYLAND
+	free(m->indep);
+#endif
 	free(m);
 }
 
@@ -741,11 +1294,11 @@ closemon(Monitor *m)
 	Client *c;
 
 	wl_list_for_each(c, &clients, link) {
-		if (c->isfloating && c->geom.x > m->m.width)
-			resize(c, c->geom.x - m->w.width, c->geom.y,
-				c->geom.width, c->geom.height, 0);
-		if (c->mon == m)
-			setmon(c, selmon, c->tags);
+		if (c->st->isfloating && c->st->geom.x > m->m.width)
+			resize(c, c->st->geom.x - m->w.width, c->st->geom.y,
+				c->st->geom.width, c->st->geom.height, 0);
+		if (c->st->mon == m)
+			setmon(c, selmon, c->st->tags);
 	}
 }
 
@@ -776,9 +1329,51 @@ commitnotify(struct wl_listener *listener, void *data)
 {
 	Client *c = wl_container_of(listener, c, commit);
 
+	PROBE(commitnotify, c, c->surface.xdg->configure_serial, c->st->resize);
+	appstats(c)->commits++;
+	if (!c->surface.xdg->configured && !c->st->mon)
+		placeclient(c);
+	if (c->id && (c->commitwidth != client_surface(c)->current.width
+				|| c->commitheight != client_surface(c)->current.height)) {
+		c->commitwidth = client_surface(c)->current.width;
+		c->commitheight = client_surface(c)->current.height;
+		record(RecCommit, 0, c->id, c->commitwidth, c->commitheight);
+	}
+
 	/* mark a pending resize as completed */
-	if (c->resize && c->resize <= c->surface.xdg->configure_serial)
-		c->resize = 0;
+	if (c->st->resize && c->st->resize <= c->surface.xdg->configure_serial) {
+		if (c->acktime)
+			histadd(&appstats(c)->commit, (nowns() - c->acktime) / 1000);
+		c->st->resize = 0;
+		c->acktime = 0;
+	}
+
+	/* the focused client reacted to input; wait for the frame showing it.
+	 * Input that caused no repaint must not pair with a later commit. */
+	if (latinput && nowns() - latinput > LATENCYMAX * 1000000ull)
+		latinput = 0;
+	if (latinput && c->st->mon && !c->st->mon->latinput
+			&& client_surface(c) == seat->keyboard_state.focused_surface) {
+		c->st->mon->latinput = latinput;
+		latinput = 0;
+	}
+}
+
+void
+compilerules(void)
+{
+	const Rule *r;
+	const MonitorRule *mr;
+
+	for (r = rules; r < END(rules); r++) {
+		matcheradd(&idmatcher, r->id, r - rules);
+		matcheradd(&titlematcher, r->title, r - rules);
+	}
+	for (mr = monrules; mr < END(monrules); mr++)
+		matcheradd(&monmatcher, mr->name, mr - monrules);
+	matcherbuild(&idmatcher);
+	matcherbuild(&titlematcher);
+	matcherbuild(&monmatcher);
 }
 
 void
@@ -786,7 +1381,7 @@ createkeyboard(struct wlr_input_device *device)
 {
 	struct xkb_context *context;
 	struct xkb_keymap *keymap;
-	Keyboard *kb = device->data = calloc(1, sizeof(*kb));
+	Keyboard *kb = device->data = poolalloc(&keyboardpool);
 	kb->device = device;
 
 	/* Prepare an XKB keymap and assign it to the keyboard. */
@@ -817,19 +1412,24 @@ createmon(struct wl_listener *listener, void *data)
 	 * monitor) becomes available. */
 	struct wlr_output *wlr_output = data;
 	const MonitorRule *r;
+	unsigned long match[BITWORDS(LENGTH(monrules))];
+	size_t w;
 	Monitor *m = wlr_output->data = calloc(1, sizeof(*m));
 	m->wlr_output = wlr_output;
 
-	/* Initialize monitor state using configured rules */
+	/* Initialize monitor state using the first matching rule */
 	for (size_t i = 0; i < LENGTH(m->layers); i++)
 		wl_list_init(&m->layers[i]);
 	m->tagset[0] = m->tagset[1] = 1;
-	for (r = monrules; r < END(monrules); r++) {
-		if (!r->name || strstr(wlr_output->name, r->name)) {
+	matcherrun(&monmatcher, wlr_output->name, match);
+	for (w = 0; w < LENGTH(match); w++) {
+		if (match[w]) {
+			r = &monrules[w * ULBITS + __builtin_ctzl(match[w])];
 			m->mfact = r->mfact;
 			m->nmaster = r->nmaster;
 			wlr_output_set_scale(wlr_output, r->scale);
-			wlr_xcursor_manager_load(cursor_mgr, r->scale);
+			if (cursorsloaded)
+				wlr_xcursor_manager_load(cursor_mgr, r->scale);
 			m->lt[0] = m->lt[1] = r->lt;
 			wlr_output_set_transform(wlr_output, r->rr);
 			break;
@@ -845,9 +1445,11 @@ createmon(struct wl_listener *listener, void *data)
 
 	/* Set up event listeners */
 	LISTEN(&wlr_output->events.frame, &m->frame, rendermon);
+	LISTEN(&wlr_output->events.present, &m->present, presentmon);
 	LISTEN(&wlr_output->events.destroy, &m->destroy, cleanupmon);
 
 	wl_list_insert(&mons, &m->link);
+	ipcevent("monitor\tadd\t%s", wlr_output->name);
 	wlr_output_enable(wlr_output, 1);
 	if (!wlr_output_commit(wlr_output))
 		return;
@@ -866,9 +1468,9 @@ createmon(struct wl_listener *listener, void *data)
 		/* The first monitor in the list is the most recently added */
 		Client *c;
 		wl_list_for_each(c, &clients, link) {
-			if (c->isfloating)
-				resize(c, c->geom.x + m->w.width, c->geom.y,
-						c->geom.width, c->geom.height, 0);
+			if (c->st->isfloating)
+				resize(c, c->st->geom.x + m->w.width, c->st->geom.y,
+						c->st->geom.width, c->st->geom.height, 0);
 		}
 		return;
 	}
@@ -885,25 +1487,32 @@ createnotify(struct wl_listener *listener, void *data)
 	if (xdg_surface->role != WLR_XDG_SURFACE_ROLE_TOPLEVEL)
 		return;
 	wl_list_for_each(c, &clients, link)
-		if (c->isfullscreen && VISIBLEON(c, c->mon))
+		if (c->st->isfullscreen && VISIBLEON(c, c->st->mon))
 			setfullscreen(c, 0);
 
 	/* Allocate a Client for this surface */
-	c = xdg_surface->data = calloc(1, sizeof(*c));
+	c = xdg_surface->data = poolalloc(&clientpool);
+	registerclient(c);
 	c->surface.xdg = xdg_surface;
-	c->bw = borderpx;
+	c->st->bw = borderpx;
 
 	/* Tell the client not to try anything fancy */
 	wlr_xdg_toplevel_set_tiled(c->surface.xdg, WLR_EDGE_TOP |
 			WLR_EDGE_BOTTOM | WLR_EDGE_LEFT | WLR_EDGE_RIGHT);
 
 	LISTEN(&xdg_surface->surface->events.commit, &c->commit, commitnotify);
+	LISTEN(&xdg_surface->events.ack_configure, &c->ackconfigure,
+			ackconfigurenotify);
 	LISTEN(&xdg_surface->events.map, &c->map, mapnotify);
 	LISTEN(&xdg_surface->events.unmap, &c->unmap, unmapnotify);
 	LISTEN(&xdg_surface->events.destroy, &c->destroy, destroynotify);
 	LISTEN(&xdg_surface->toplevel->events.request_fullscreen, &c->fullscreen,
 			fullscreennotify);
-	c->isfullscreen = 0;
+	LISTEN(&xdg_surface->toplevel->events.set_title, &c->settitle,
+			updatetitle);
+	LISTEN(&xdg_surface->toplevel->events.set_app_id, &c->setappid,
+			updateappid);
+	c->st->isfullscreen = 0;
 }
 
 void
@@ -918,7 +1527,7 @@ createlayersurface(struct wl_listener *listener, void *data)
 		wlr_layer_surface->output = selmon->wlr_output;
 	}
 
-	layersurface = calloc(1, sizeof(LayerSurface));
+	layersurface = poolalloc(&layersurfacepool);
 	LISTEN(&wlr_layer_surface->surface->events.commit,
 		&layersurface->surface_commit, commitlayersurfacenotify);
 	LISTEN(&wlr_layer_surface->events.destroy, &layersurface->destroy,
@@ -968,7 +1577,7 @@ void
 createxdeco(struct wl_listener *listener, void *data)
 {
 	struct wlr_xdg_toplevel_decoration_v1 *wlr_deco = data;
-	Decoration *d = wlr_deco->data = calloc(1, sizeof(*d));
+	Decoration *d = wlr_deco->data = poolalloc(&decorationpool);
 
 	LISTEN(&wlr_deco->events.request_mode, &d->request_mode, getxdecomode);
 	LISTEN(&wlr_deco->events.destroy, &d->destroy, destroyxdeco);
@@ -1005,7 +1614,7 @@ destroylayersurfacenotify(struct wl_listener *listener, void *data)
 			arrangelayers(m);
 		layersurface->layer_surface->output = NULL;
 	}
-	free(layersurface);
+	poolfree(&layersurfacepool, layersurface);
 }
 
 void
@@ -1017,13 +1626,27 @@ destroynotify(struct wl_listener *listener, void *data)
 	wl_list_remove(&c->unmap.link);
 	wl_list_remove(&c->destroy.link);
 	wl_list_remove(&c->fullscreen.link);
+	wl_list_remove(&c->settitle.link);
+	wl_list_remove(&c->setappid.link);
+	if (!client_is_x11(c)) {
+		wl_list_remove(&c->commit.link);
+		wl_list_remove(&c->ackconfigure.link);
+	}
 #ifdef XWAYLAND
-	if (c->type == X11Managed)
+	else if (c->type == X11Managed)
 		wl_list_remove(&c->activate.link);
-	else if (c->type == XDGShell)
+	else
+		wl_list_remove(&c->setgeometry.link);
+	if (client_is_x11(c))
+		wl_list_remove(&c->configlink);
+	if (xc && c->synccookie)
+		xcb_discard_reply(xc, c->synccookie);
+	if (xc && c->syncalarm)
+		xcb_sync_destroy_alarm(xc, c->syncalarm);
 #endif
-		wl_list_remove(&c->commit.link);
-	free(c);
+	free(c->matched);
+	unregisterclient(c);
+	poolfree(&clientpool, c);
 }
 
 void
@@ -1034,43 +1657,43 @@ destroyxdeco(struct wl_listener *listener, void *data)
 
 	wl_list_remove(&d->destroy.link);
 	wl_list_remove(&d->request_mode.link);
-	free(d);
+	poolfree(&decorationpool, d);
 }
 
 void
 togglefullscreen(const Arg *arg)
 {
 	Client *sel = selclient();
-	setfullscreen(sel, !sel->isfullscreen);
+	setfullscreen(sel, !sel->st->isfullscreen);
 }
 
 void
 maximizeclient(Client *c)
 {
-	resize(c, c->mon->m.x, c->mon->m.y, c->mon->m.width, c->mon->m.height, 0);
+	resize(c, c->st->mon->m.x, c->st->mon->m.y, c->st->mon->m.width, c->st->mon->m.height, 0);
 	/* used for fullscreen clients */
 }
 
 void
 setfullscreen(Client *c, int fullscreen)
 {
-	c->isfullscreen = fullscreen;
-	c->bw = (1 - fullscreen) * borderpx;
+	c->st->isfullscreen = fullscreen;
+	c->st->bw = (1 - fullscreen) * borderpx;
 	client_set_fullscreen(c, fullscreen);
 
 	if (fullscreen) {
-		c->prevx = c->geom.x;
-		c->prevy = c->geom.y;
-		c->prevheight = c->geom.height;
-		c->prevwidth = c->geom.width;
-		c->mon->fullscreenclient = c;
+		c->prevx = c->st->geom.x;
+		c->prevy = c->st->geom.y;
+		c->prevheight = c->st->geom.height;
+		c->prevwidth = c->st->geom.width;
+		c->st->mon->fullscreenclient = c;
 		maximizeclient(c);
 	} else {
 		/* restore previous size instead of arrange for floating windows since
 		 * client positions are set by the user and cannot be recalculated */
 		resize(c, c->prevx, c->prevy, c->prevwidth, c->prevheight, 0);
-		c->mon->fullscreenclient = NULL;
-		arrange(c->mon);
+		c->st->mon->fullscreenclient = NULL;
+		arrange(c->st->mon);
 	}
 }
 
@@ -1078,7 +1701,8 @@ void
 fullscreennotify(struct wl_listener *listener, void *data)
 {
 	Client *c = wl_container_of(listener, c, fullscreen);
-	setfullscreen(c, !c->isfullscreen);
+	record(RecFullscreen, !c->st->isfullscreen, c->id, 0, 0);
+	setfullscreen(c, !c->st->isfullscreen);
 }
 
 Monitor *
@@ -1095,6 +1719,38 @@ dirtomon(enum wlr_direction dir)
 	return selmon;
 }
 
+Monitor *
+evalrules(Client *c, unsigned int *newtags)
+{
+	/* rule matching: sets the floating state of c, returns its monitor */
+	unsigned long match[BITWORDS(LENGTH(rules))];
+	unsigned int i, n;
+	const Rule *r;
+	Monitor *mon = c->st->mon ? c->st->mon : selmon, *m;
+
+	c->st->isfloating = client_is_float_type(c);
+	rulematch(c, match);
+	if (!c->matched && !(c->matched = malloc(sizeof(match))))
+		EBARF("can't allocate rule matches");
+	memcpy(c->matched, match, sizeof(match));
+	*newtags = 0;
+
+	/* matching rules in table order, so later ones win */
+	for (i = 0; i < LENGTH(match); i++) {
+		while (match[i]) {
+			r = &rules[i * ULBITS + __builtin_ctzl(match[i])];
+			match[i] &= match[i] - 1;
+			c->st->isfloating = r->isfloating;
+			*newtags |= r->tags;
+			n = 0;
+			wl_list_for_each(m, &mons, link)
+				if (r->monitor == n++)
+					mon = m;
+		}
+	}
+	return mon;
+}
+
 void
 focusclient(Client *c, int lift)
 {
@@ -1105,16 +1761,27 @@ focusclient(Client *c, int lift)
 	if (c && lift) {
 		wl_list_remove(&c->slink);
 		wl_list_insert(&stack, &c->slink);
+		c->st->stackseq = ++seqclock;
 	}
 
-	if (c && client_surface(c) == old)
+	if (c && client_surface(c) == old && !batching)
 		return;
+	/* a pending latency sample belongs to the old focus */
+	latinput = 0;
 
 	/* Put the new client atop the focus stack and select its monitor */
 	if (c) {
 		wl_list_remove(&c->flink);
 		wl_list_insert(&fstack, &c->flink);
-		selmon = c->mon;
+		c->st->focusseq = ++seqclock;
+		selmon = c->st->mon;
+	}
+
+	/* Only the last focus change of a batch reaches the seat */
+	if (batching) {
+		batchfocus = c;
+		focuspending = 1;
+		return;
 	}
 
 	/* Deactivate old client if focus is changing */
@@ -1137,6 +1804,8 @@ focusclient(Client *c, int lift)
 			client_activate_surface(old, 0);
 		}
 	}
+	statechanged();
+	ipcclientevent("focus", c);
 
 	if (!c) {
 		/* With no client, all we have left is to clear focus */
@@ -1191,11 +1860,15 @@ focusstack(const Arg *arg)
 Client *
 focustop(Monitor *m)
 {
-	Client *c;
-	wl_list_for_each(c, &fstack, flink)
-		if (VISIBLEON(c, m))
-			return c;
-	return NULL;
+	/* The visible client that went to the head of fstack last */
+	ClientState *s, *top = NULL;
+
+	if (!m)
+		return NULL;
+	for (s = cstate; s < cstate + ncstate; s++)
+		if (ISVISIBLE(s, m) && (!top || s->focusseq > top->focusseq))
+			top = s;
+	return top ? top->c : NULL;
 }
 
 void
@@ -1206,6 +1879,58 @@ getxdecomode(struct wl_listener *listener, void *data)
 			WLR_XDG_TOPLEVEL_DECORATION_V1_MODE_SERVER_SIDE);
 }
 
+void
+handlerdone(Handler *h, uint64_t start)
+{
+	uint64_t ns = tracespan(h->name, start) - start;
+
+	if (!h->calls++) {
+		h->next = handlers;
+		handlers = h;
+	}
+	h->ns += ns;
+	h->maxns = MAX(h->maxns, ns);
+	if (ns > slowestns) {
+		slowest = h;
+		slowestns = ns;
+	}
+	/* idle sources run at the end of the iteration */
+	if (!loopstart)
+		wl_event_loop_add_idle(wl_display_get_event_loop(dpy), loopdone, NULL);
+	if (!loopstart || start < loopstart)
+		loopstart = start;
+}
+
+void
+histadd(Hist *h, uint64_t us)
+{
+	unsigned int e, i = us;
+
+	if (us >= 8) {
+		for (e = 3; us >> (e + 1); e++)
+			;
+		i = MIN(HISTLEN - 1, e * 4 + ((us >> (e - 2)) & 3));
+	}
+	h->b[i]++;
+	h->n++;
+	h->sum += us;
+	h->max = MAX(h->max, us);
+}
+
+uint64_t
+histpct(Hist *h, double p)
+{
+	/* Upper bound of the bucket holding the p-th sample */
+	uint64_t seen = 0, want = h->n * p;
+	unsigned int i;
+
+	for (i = 0; i < HISTLEN; i++)
+		if ((seen += h->b[i]) > want)
+			return MIN(h->max, i < 8 ? i :
+					((4 + (i & 3) + 1ull) << (i / 4 - 2)) - 1);
+	return h->max;
+}
+
 void
 incnmaster(const Arg *arg)
 {
@@ -1243,6 +1968,27 @@ inputdevice(struct wl_listener *listener, void *data)
 	wlr_seat_set_capabilities(seat, caps);
 }
 
+void
+inputhandled(uint32_t time)
+{
+	/* Called by every input handler with the event's hardware timestamp.
+	 * Start a latency sample unless one is already waiting for the focused
+	 * client to commit; commitnotify() and presentmon() carry it on. */
+	uint64_t now = nowns();
+	/* the timestamp is CLOCK_MONOTONIC milliseconds cut to 32 bits, so
+	 * compare modulo 2^32; nested backends may use another clock base */
+	uint32_t age = (uint32_t)(now / 1000000) - time;
+	uint64_t when = now - age * 1000000ull;
+	int sameclock = age < 10000;
+
+	if (!latinput)
+		latinput = sameclock ? when : now;
+	/* the kernel stamped the event, so this is how long it sat in the
+	 * queue behind other work (to the millisecond wlroots passes on) */
+	if (sameclock)
+		histadd(&inputdelay, (now - when) / 1000);
+}
+
 int
 keybinding(uint32_t mods, xkb_keysym_t sym)
 {
@@ -1263,105 +2009,910 @@ keybinding(uint32_t mods, xkb_keysym_t sym)
 	return handled;
 }
 
-void
-keypress(struct wl_listener *listener, void *data)
+int
+ipcaccept(int fd, uint32_t mask, void *data)
 {
-	int i;
-	/* This event is raised when a key is pressed or released. */
-	Keyboard *kb = wl_container_of(listener, kb, key);
-	struct wlr_event_keyboard_key *event = data;
-
-	/* Translate libinput keycode -> xkbcommon */
-	uint32_t keycode = event->keycode + 8;
-	/* Get a list of keysyms based on the keymap for this keyboard */
-	const xkb_keysym_t *syms;
-	int nsyms = xkb_state_key_get_syms(
-			kb->device->keyboard->xkb_state, keycode, &syms);
-
-	int handled = 0;
-	uint32_t mods = wlr_keyboard_get_modifiers(kb->device->keyboard);
-
-	wlr_idle_notify_activity(idle, seat);
-
-	/* On _press_, attempt to process a compositor keybinding. */
-	if (event->state == WL_KEYBOARD_KEY_STATE_PRESSED)
-		for (i = 0; i < nsyms; i++)
-			handled = keybinding(mods, syms[i]) || handled;
-
-	if (!handled) {
-		/* Pass unhandled keycodes along to the client. */
-		wlr_seat_set_keyboard(seat, kb->device);
-		wlr_seat_keyboard_notify_key(seat, event->time_msec,
-			event->keycode, event->state);
+	IpcClient *ic;
+	int cfd;
+
+	if ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return 0;
+	if (!(ic = calloc(1, sizeof(*ic)))) {
+		close(cfd);
+		return 0;
 	}
+	ic->fd = cfd;
+	ic->source = wl_event_loop_add_fd(wl_display_get_event_loop(dpy), cfd,
+			WL_EVENT_READABLE, ipcdispatchtraced, ic);
+	wl_list_insert(&ipcclients, &ic->link);
+	return 0;
 }
 
 void
-keypressmod(struct wl_listener *listener, void *data)
+ipcclientevent(const char *name, Client *c)
 {
-	/* This event is raised when a modifier key, such as shift or alt, is
-	 * pressed. We simply communicate this to the client. */
-	Keyboard *kb = wl_container_of(listener, kb, modifiers);
-	/*
-	 * A seat can only have one keyboard, but this is a limitation of the
-	 * Wayland protocol - not wlroots. We assign all connected keyboards to the
-	 * same seat. You can swap out the underlying wlr_keyboard like this and
-	 * wlr_seat handles this transparently.
-	 */
-	wlr_seat_set_keyboard(seat, kb->device);
-	/* Send modifiers to the client. */
-	wlr_seat_keyboard_notify_modifiers(seat,
-		&kb->device->keyboard->modifiers);
+	/* ipcevent() flattens newlines; tabs would split the fields */
+	const char *appid = c ? client_get_appid(c) : "";
+	const char *title = c ? client_get_title(c) : "";
+	char id[256], t[256], *p;
+
+	snprintf(id, sizeof(id), "%s", appid ? appid : broken);
+	snprintf(t, sizeof(t), "%s", title ? title : broken);
+	while ((p = strchr(id, '\t')))
+		*p = ' ';
+	while ((p = strchr(t, '\t')))
+		*p = ' ';
+	ipcevent("%s\t%s\t%s", name, id, t);
 }
 
 void
-killclient(const Arg *arg)
+ipcclose(IpcClient *ic)
 {
-	Client *sel = selclient();
-	if (!sel)
-		return;
-	client_send_close(sel);
+	ic->batcherror = 1;
+	ipcendbatch(ic);
+	free(ic->batch);
+	free(ic->out);
+	wl_event_source_remove(ic->source);
+	close(ic->fd);
+	wl_list_remove(&ic->link);
+	free(ic);
 }
 
 void
-maplayersurfacenotify(struct wl_listener *listener, void *data)
+ipccommand(IpcClient *ic, char *line)
 {
-	LayerSurface *layersurface = wl_container_of(listener, layersurface, map);
-	wlr_surface_send_enter(layersurface->layer_surface->surface, layersurface->layer_surface->output);
-	motionnotify(0);
+	/* Anything but "subscribe", "metrics" and "trace" is part of a batch,
+	 * which is checked line by line and applied as a whole at an empty
+	 * line or end of input */
+	const IpcCommand *cmd;
+	Command *b;
+	char *arg, *end, path[256];
+	const char **argv;
+	size_t i;
+
+	if (!*line) {
+		ipcendbatch(ic);
+		return;
+	}
+	if (!strcmp(line, "subscribe")) {
+		ic->subscribed = 1;
+		return;
+	}
+	if (!strcmp(line, "metrics")) {
+		ipcmetrics(ic);
+		return;
+	}
+	if (!strcmp(line, "trace")) {
+		if (writetrace(path, sizeof(path)) < 0)
+			ipcprintf(ic, "error\tcan't write trace: %s", strerror(errno));
+		else
+			ipcprintf(ic, "trace\t%s", path);
+		return;
+	}
+	if ((arg = strchr(line, ' ')))
+		*arg++ = '\0';
+	for (cmd = ipccommands; cmd < END(ipccommands); cmd++)
+		if (!strcmp(line, cmd->name))
+			break;
+	if (cmd == END(ipccommands)) {
+		ipcprintf(ic, "error\tunknown command: %s", line);
+		ic->batcherror = 1;
+		return;
+	}
+
+	if (ic->nbatch == ic->batchcap) {
+		ic->batchcap = ic->batchcap ? ic->batchcap * 2 : 16;
+		if (!(b = realloc(ic->batch, ic->batchcap * sizeof(*b)))) {
+			ic->batchcap = ic->nbatch;
+			ipcprintf(ic, "error\tout of memory");
+			ic->batcherror = 1;
+			return;
+		}
+		ic->batch = b;
+	}
+	b = &ic->batch[ic->nbatch];
+	b->func = cmd->func;
+	b->arg.v = NULL;
+	end = NULL;
+
+	switch (cmd->argtype) {
+	case ArgNone:
+		end = arg ? arg : "";
+		break;
+	case ArgInt:
+		if (arg && *arg)
+			b->arg.i = strtol(arg, &end, 0);
+		break;
+	case ArgTags:
+		if (arg && !strcmp(arg, "all"))
+			b->arg.ui = ~0, end = "";
+		else if (arg && *arg)
+			b->arg.ui = strtoul(arg, &end, 0);
+		break;
+	case ArgFloat:
+		if (arg && *arg)
+			b->arg.f = strtof(arg, &end);
+		break;
+	case ArgLayout:
+		/* no symbol toggles back to the previous layout */
+		end = "";
+		for (i = 0; arg && i < LENGTH(layouts); i++)
+			if (!strcmp(arg, layouts[i].symbol))
+				b->arg.v = &layouts[i];
+		if (arg && !b->arg.v)
+			end = NULL;
+		break;
+	case ArgDir:
+		if (!arg)
+			break;
+		end = "";
+		if (!strcmp(arg, "left"))
+			b->arg.i = WLR_DIRECTION_LEFT;
+		else if (!strcmp(arg, "right"))
+			b->arg.i = WLR_DIRECTION_RIGHT;
+		else if (!strcmp(arg, "up"))
+			b->arg.i = WLR_DIRECTION_UP;
+		else if (!strcmp(arg, "down"))
+			b->arg.i = WLR_DIRECTION_DOWN;
+		else
+			end = NULL;
+		break;
+	case ArgCmd:
+		if (!arg || !*arg || !(argv = calloc(4, sizeof(*argv))))
+			break;
+		argv[0] = "/bin/sh";
+		argv[1] = "-c";
+		if (!(argv[2] = strdup(arg))) {
+			free(argv);
+			break;
+		}
+		b->arg.v = argv;
+		end = "";
+		break;
+	}
+	if (!end || *end) {
+		ipcprintf(ic, "error\tbad argument to %s: %s", cmd->name, arg ? arg : "");
+		ic->batcherror = 1;
+		return;
+	}
+	ic->nbatch++;
+}
+
+int
+ipcdispatch(int fd, uint32_t mask, void *data)
+{
+	IpcClient *ic = data;
+	char *line, *nl;
+	ssize_t n = -1;
+
+	if ((mask & WL_EVENT_WRITABLE) && ipcflush(ic) < 0) {
+		ipcclose(ic);
+		return 0;
+	}
+	if ((mask & WL_EVENT_READABLE) && !ic->eof) {
+		while ((n = read(fd, ic->in + ic->inlen, sizeof(ic->in) - ic->inlen)) > 0) {
+			ic->inlen += n;
+			line = ic->in;
+			while ((nl = memchr(line, '\n', ic->in + ic->inlen - line))) {
+				*nl = '\0';
+				ipccommand(ic, line);
+				line = nl + 1;
+			}
+			ic->inlen -= line - ic->in;
+			memmove(ic->in, line, ic->inlen);
+			if (ic->inlen == sizeof(ic->in))
+				break; /* line too long */
+		}
+		/* A subscriber may shut down its side and keep reading, anything
+		 * else is done once it stops sending and has its replies */
+		if (n == 0)
+			ipcendbatch(ic);
+		if (n == 0 && (ic->subscribed || ic->outlen))
+			ic->eof = 1;
+		else if (n >= 0 || (errno != EAGAIN && errno != EINTR)) {
+			ipcclose(ic);
+			return 0;
+		}
+	}
+	if (((mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR)) || (ic->eof && !ic->subscribed))
+			&& !ic->outlen) {
+		ipcclose(ic);
+		return 0;
+	}
+	ipcupdate(ic);
+	return 0;
 }
 
 void
-mapnotify(struct wl_listener *listener, void *data)
+ipcendbatch(IpcClient *ic)
 {
-	/* Called when the surface is mapped, or ready to display on-screen. */
-	Client *c = wl_container_of(listener, c, map), *oldfocus = selclient();
+	Monitor *m;
+	size_t i;
 
-	if (client_is_unmanaged(c)) {
-		/* Insert this independent into independents lists. */
-		wl_list_insert(&independents, &c->link);
+	if (!ic->nbatch && !ic->batcherror)
 		return;
+	if (ic->batcherror) {
+		ipcprintf(ic, "error\tbatch of %lu commands not applied",
+				(unsigned long)ic->nbatch);
+	} else {
+		batching++;
+		for (i = 0; i < ic->nbatch; i++)
+			ic->batch[i].func(&ic->batch[i].arg);
+		batching--;
+		wl_list_for_each(m, &mons, link)
+			if (m->arrangepending)
+				arrange(m);
+		if (focuspending)
+			focusclient(batchfocus, 0);
+		focuspending = 0;
+		batchfocus = NULL;
+		ipcprintf(ic, "ok\t%lu", (unsigned long)ic->nbatch);
 	}
 
-	/* Insert this client into client lists. */
+	for (i = 0; i < ic->nbatch; i++)
+		if (ic->batch[i].func == spawn) {
+			free((void *)((const char **)ic->batch[i].arg.v)[2]);
+			free((void *)ic->batch[i].arg.v);
+		}
+	ic->nbatch = 0;
+	ic->batcherror = 0;
+}
+
+void
+ipcevent(const char *fmt, ...)
+{
+	/* Send a line to every subscriber without ever waiting on one.  Lines
+	 * are tab-separated fields:
+	 *   focus <app_id> <title>      map <app_id> <title>
+	 *   unmap <app_id> <title>      tags <output> <tagmask>
+	 *   layout <output> <symbol>    monitor add|remove <output>
+	 *   dropped <count>  (that many events did not fit in the buffer) */
+	IpcClient *ic;
+	char line[512];
+	va_list ap;
+	int i, n;
+
+	if (wl_list_empty(&ipcclients))
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	n = MIN(n, (int)sizeof(line) - 2);
+	for (i = 0; i < n; i++)
+		if (line[i] == '\n' || line[i] == '\r')
+			line[i] = ' ';
+	line[n++] = '\n';
+
+	wl_list_for_each(ic, &ipcclients, link) {
+		if (!ic->subscribed)
+			continue;
+		if (ic->dropped && ipcprintf(ic, "dropped\t%lu", ic->dropped) == 0)
+			ic->dropped = 0;
+		if (ic->dropped || ipcwrite(ic, line, n, IPCOUTLEN) < 0)
+			ic->dropped++;
+	}
+}
+
+int
+ipcflush(IpcClient *ic)
+{
+	ssize_t n;
+	size_t len;
+
+	while (ic->outlen) {
+		len = MIN(ic->outlen, ic->outcap - ic->outhead);
+		if ((n = send(ic->fd, ic->out + ic->outhead, len, MSG_NOSIGNAL)) < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		ic->outhead = (ic->outhead + n) % ic->outcap;
+		ic->outlen -= n;
+	}
+	ic->outhead = 0;
+	/* give back the room a large reply needed */
+	if (ic->outcap > IPCOUTLEN) {
+		free(ic->out);
+		ic->out = NULL;
+		ic->outcap = 0;
+	}
+	return 0;
+}
+
+void
+ipcmetrics(IpcClient *ic)
+{
+	/* Prometheus text exposition format, built whole so that it is
+	 * either queued complete or answered with an error */
+	AppStats *a;
+	Handler *h;
+	Monitor *m;
+	unsigned long rss = 0;
+	char *buf = NULL, labels[300];
+	size_t i, len = 0;
+	FILE *f, *out;
+
+	if (!(out = open_memstream(&buf, &len))) {
+		ipcprintf(ic, "error\tout of memory");
+		return;
+	}
+	fprintf(out, "# TYPE dwl_frames_total counter\n");
+	wl_list_for_each(m, &mons, link)
+		fprintf(out, "dwl_frames_total{output=\"%s\"} %lu\n",
+				m->wlr_output->name, m->frames);
+	fprintf(out, "# TYPE dwl_frames_skipped_total counter\n");
+	wl_list_for_each(m, &mons, link)
+		fprintf(out, "dwl_frames_skipped_total{output=\"%s\"} %lu\n",
+				m->wlr_output->name, m->skipped);
+	fprintf(out, "# TYPE dwl_input_to_photon_seconds summary\n");
+	wl_list_for_each(m, &mons, link) {
+		snprintf(labels, sizeof(labels), "output=\"%s\"", promescape(m->wlr_output->name));
+		promsummary(out, "dwl_input_to_photon_seconds", labels, &m->latency);
+	}
+
+	fprintf(out, "# TYPE dwl_commits_total counter\n");
+	for (a = apps; a; a = a->next)
+		fprintf(out, "dwl_commits_total{app_id=\"%s\"} %lu\n",
+				promescape(a->appid), a->commits);
+	fprintf(out, "# TYPE dwl_configures_total counter\n");
+	for (a = apps; a; a = a->next)
+		fprintf(out, "dwl_configures_total{app_id=\"%s\"} %lu\n",
+				promescape(a->appid), a->sent);
+	fprintf(out, "# TYPE dwl_configures_coalesced_total counter\n");
+	for (a = apps; a; a = a->next)
+		fprintf(out, "dwl_configures_coalesced_total{app_id=\"%s\"} %lu\n",
+				promescape(a->appid), a->coalesced);
+	fprintf(out, "# TYPE dwl_configure_ack_seconds summary\n");
+	for (a = apps; a; a = a->next) {
+		snprintf(labels, sizeof(labels), "app_id=\"%s\"", promescape(a->appid));
+		promsummary(out, "dwl_configure_ack_seconds", labels, &a->ack);
+	}
+	fprintf(out, "# TYPE dwl_configure_commit_seconds summary\n");
+	for (a = apps; a; a = a->next) {
+		snprintf(labels, sizeof(labels), "app_id=\"%s\"", promescape(a->appid));
+		promsummary(out, "dwl_configure_commit_seconds", labels, &a->commit);
+	}
+
+	fprintf(out, "# TYPE dwl_arranges_total counter\n");
+	fprintf(out, "dwl_arranges_total %lu\n", arranges);
+	fprintf(out, "# TYPE dwl_hit_tests_total counter\n");
+	fprintf(out, "dwl_hit_tests_total %lu\n", hittests);
+	fprintf(out, "# TYPE dwl_loop_iterations_total counter\n");
+	fprintf(out, "dwl_loop_iterations_total %lu\n", loopiterations);
+	fprintf(out, "# TYPE dwl_dispatch_seconds_total counter\n");
+	fprintf(out, "dwl_dispatch_seconds_total %.6f\n", dispatchns / 1e9);
+	fprintf(out, "# TYPE dwl_stalls_total counter\n");
+	fprintf(out, "dwl_stalls_total %lu\n", stalls);
+	fprintf(out, "# TYPE dwl_handler_calls_total counter\n");
+	for (h = handlers; h; h = h->next)
+		fprintf(out, "dwl_handler_calls_total{handler=\"%s\"} %lu\n",
+				h->name, h->calls);
+	fprintf(out, "# TYPE dwl_handler_seconds_total counter\n");
+	for (h = handlers; h; h = h->next)
+		fprintf(out, "dwl_handler_seconds_total{handler=\"%s\"} %.6f\n",
+				h->name, h->ns / 1e9);
+	fprintf(out, "# TYPE dwl_handler_max_seconds gauge\n");
+	for (h = handlers; h; h = h->next)
+		fprintf(out, "dwl_handler_max_seconds{handler=\"%s\"} %.6f\n",
+				h->name, h->maxns / 1e9);
+
+#ifdef XWAYLAND
+	fprintf(out, "# TYPE dwl_xwayland_starts_total counter\n");
+	fprintf(out, "dwl_xwayland_starts_total %lu\n", xwaylandstarts);
+	fprintf(out, "# TYPE dwl_xwayland_restarts_total counter\n");
+	fprintf(out, "dwl_xwayland_restarts_total %lu\n", xwaylandrestarts);
+	fprintf(out, "# TYPE dwl_x11_configure_requests_total counter\n");
+	fprintf(out, "dwl_x11_configure_requests_total %lu\n", configrequests);
+	fprintf(out, "# TYPE dwl_x11_configures_total counter\n");
+	fprintf(out, "dwl_x11_configures_total %lu\n", configsent);
+	fprintf(out, "# TYPE dwl_xsync_timeouts_total counter\n");
+	fprintf(out, "dwl_xsync_timeouts_total %lu\n", synctimeouts);
+	fprintf(out, "# TYPE dwl_xwayland_start_seconds gauge\n");
+	fprintf(out, "dwl_xwayland_start_seconds{path=\"start\"} %.6f\n",
+			xwaylandstartns[0] / 1e9);
+	fprintf(out, "dwl_xwayland_start_seconds{path=\"restart\"} %.6f\n",
+			xwaylandstartns[1] / 1e9);
+#endif
+
+	fprintf(out, "# TYPE dwl_objects gauge\n");
+	for (i = 0; i < LENGTH(pools); i++)
+		fprintf(out, "dwl_objects{type=\"%s\"} %lu\n",
+				pools[i]->name, pools[i]->live);
+	fprintf(out, "# TYPE dwl_objects_peak gauge\n");
+	for (i = 0; i < LENGTH(pools); i++)
+		fprintf(out, "dwl_objects_peak{type=\"%s\"} %lu\n",
+				pools[i]->name, pools[i]->peak);
+	fprintf(out, "# TYPE dwl_allocations_total counter\n");
+	for (i = 0; i < LENGTH(pools); i++)
+		fprintf(out, "dwl_allocations_total{type=\"%s\"} %lu\n",
+				pools[i]->name, pools[i]->allocs);
+	fprintf(out, "# TYPE dwl_pool_bytes gauge\n");
+	for (i = 0; i < LENGTH(pools); i++)
+		fprintf(out, "dwl_pool_bytes{type=\"%s\"} %lu\n", pools[i]->name,
+				pools[i]->nslabs * (POOLALIGN + POOLSLAB * pools[i]->size));
+
+	if ((f = fopen("/proc/self/statm", "r"))) {
+		if (fscanf(f, "%*u %lu", &rss) != 1)
+			rss = 0;
+		fclose(f);
+	}
+	fprintf(out, "# TYPE dwl_resident_bytes gauge\n");
+	fprintf(out, "dwl_resident_bytes %lu\n", rss * sysconf(_SC_PAGESIZE));
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	fprintf(out, "# TYPE dwl_heap_bytes gauge\n");
+	fprintf(out, "dwl_heap_bytes %zu\n", mallinfo2().uordblks);
+#endif
+
+	if (fclose(out) || ipcwrite(ic, buf, len, IPCOUTMAX) < 0)
+		ipcprintf(ic, "error\tmetrics do not fit in %d bytes", IPCOUTMAX);
+	free(buf);
+}
+
+int
+ipcprintf(IpcClient *ic, const char *fmt, ...)
+{
+	/* Queue a reply line, all or nothing */
+	char line[512];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return -1;
+	n = MIN(n, (int)sizeof(line) - 2);
+	line[n++] = '\n';
+	return ipcwrite(ic, line, n, IPCOUTMAX);
+}
+
+void
+ipcupdate(IpcClient *ic)
+{
+	/* Output is written when the event loop finds the socket writable */
+	wl_event_source_fd_update(ic->source,
+			(ic->eof ? 0 : WL_EVENT_READABLE)
+			| (ic->outlen ? WL_EVENT_WRITABLE : 0));
+}
+
+int
+ipcwrite(IpcClient *ic, const char *buf, size_t len, size_t max)
+{
+	/* Queue output, all or nothing, growing the ring up to max bytes */
+	size_t cap, first;
+	char *out;
+
+	if (ic->outlen + len > max)
+		return -1;
+	if (!ic->out || ic->outcap - ic->outlen < len) {
+		cap = MAX(ic->outcap, IPCOUTLEN);
+		while (cap < ic->outlen + len)
+			cap *= 2;
+		if (!(out = malloc(cap)))
+			return -1;
+		first = MIN(ic->outlen, ic->outcap - ic->outhead);
+		if (ic->outlen) {
+			memcpy(out, ic->out + ic->outhead, first);
+			memcpy(out + first, ic->out, ic->outlen - first);
+		}
+		free(ic->out);
+		ic->out = out;
+		ic->outcap = cap;
+		ic->outhead = 0;
+	}
+	first = MIN(len, ic->outcap - (ic->outhead + ic->outlen) % ic->outcap);
+	memcpy(ic->out + (ic->outhead + ic->outlen) % ic->outcap, buf, first);
+	memcpy(ic->out, buf + first, len - first);
+	ic->outlen += len;
+	ipcupdate(ic);
+	return 0;
+}
+
+void
+keypress(struct wl_listener *listener, void *data)
+{
+	int i;
+	/* This event is raised when a key is pressed or released. */
+	Keyboard *kb = wl_container_of(listener, kb, key);
+	struct wlr_event_keyboard_key *event = data;
+
+	/* Translate libinput keycode -> xkbcommon */
+	uint32_t keycode = event->keycode + 8;
+	/* Get a list of keysyms based on the keymap for this keyboard */
+	const xkb_keysym_t *syms;
+	int nsyms = xkb_state_key_get_syms(
+			kb->device->keyboard->xkb_state, keycode, &syms);
+
+	int handled = 0;
+	uint32_t mods = wlr_keyboard_get_modifiers(kb->device->keyboard);
+
+	PROBE(keypress_entry, keycode, event->state, mods);
+	record(RecKey, event->state, event->keycode, 0, 0);
+	inputhandled(event->time_msec);
+	wlr_idle_notify_activity(idle, seat);
+
+	/* On _press_, attempt to process a compositor keybinding. */
+	if (event->state == WL_KEYBOARD_KEY_STATE_PRESSED)
+		for (i = 0; i < nsyms; i++)
+			handled = keybinding(mods, syms[i]) || handled;
+
+	if (!handled) {
+		/* Pass unhandled keycodes along to the client. */
+		wlr_seat_set_keyboard(seat, kb->device);
+		wlr_seat_keyboard_notify_key(seat, event->time_msec,
+			event->keycode, event->state);
+	}
+	PROBE(keypress_return, keycode, handled);
+}
+
+void
+keypressmod(struct wl_listener *listener, void *data)
+{
+	/* This event is raised when a modifier key, such as shift or alt, is
+	 * pressed. We simply communicate this to the client. */
+	Keyboard *kb = wl_container_of(listener, kb, modifiers);
+	/*
+	 * A seat can only have one keyboard, but this is a limitation of the
+	 * Wayland protocol - not wlroots. We assign all connected keyboards to the
+	 * same seat. You can swap out the underlying wlr_keyboard like this and
+	 * wlr_seat handles this transparently.
+	 */
+	wlr_seat_set_keyboard(seat, kb->device);
+	/* Send modifiers to the client. */
+	wlr_seat_keyboard_notify_modifiers(seat,
+		&kb->device->keyboard->modifiers);
+}
+
+void
+killclient(const Arg *arg)
+{
+	Client *sel = selclient();
+	if (!sel)
+		return;
+	client_send_close(sel);
+}
+
+pid_t
+launch(char *const argv[], int newsession)
+{
+	/* posix_spawn uses vfork semantics, so starting a program does not copy
+	 * the compositor's page tables.  Children get default signal handling
+	 * and an empty mask since SIGCHLD is blocked for the signalfd. */
+	struct clone_args args = {
+		.flags = CLONE_INTO_CGROUP | CLONE_VFORK,
+		.exit_signal = SIGCHLD,
+		.cgroup = cgroupfd,
+	};
+	posix_spawnattr_t attr;
+	sigset_t set;
+	pid_t pid;
+	int err;
+
+	/* The child inherits the affinity of the spawning thread */
+	if (compositorcpus || clientcpus)
+		sched_setaffinity(0, sizeof(clientmask), &clientmask);
+
+	if (cgroupfd >= 0) {
+		/* The kernel starts the child in clientcgroup, so nothing it runs
+		 * can escape.  dwl sets no signal handlers, only blocks signals
+		 * for its signalfds; the child only makes async-signal-safe calls
+		 * since other threads may hold locks. */
+		sigemptyset(&set);
+		if ((pid = syscall(SYS_clone3, &args, sizeof(args))) == 0) {
+			sigprocmask(SIG_SETMASK, &set, NULL);
+			if (newsession)
+				setsid();
+			execvp(argv[0], argv);
+			_exit(127);
+		}
+		err = pid < 0 ? errno : 0;
+		goto spawned;
+	}
+
+	posix_spawnattr_init(&attr);
+	sigemptyset(&set);
+	posix_spawnattr_setsigmask(&attr, &set);
+	sigfillset(&set);
+	posix_spawnattr_setsigdefault(&attr, &set);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK
+			| POSIX_SPAWN_SETSIGDEF | (newsession ? POSIX_SPAWN_SETSID : 0));
+	err = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+
+spawned:
+	if (compositorcpus || clientcpus)
+		sched_setaffinity(0, sizeof(compositormask), &compositormask);
+	if (err) {
+		fprintf(stderr, "dwl: can't spawn %s: %s\n", argv[0], strerror(err));
+		return -1;
+	}
+
+	launches[nlaunches % LAUNCHLEN].pid = pid;
+	launches[nlaunches++ % LAUNCHLEN].time = nowns();
+	return pid;
+}
+
+int
+launchedby(pid_t pid)
+{
+	/* Index of the launch that started pid or its parent, e.g. sh -c */
+	char path[32], buf[512], *p;
+	FILE *f;
+	int i, tries;
+
+	for (tries = 0; tries < 2 && pid > 1; tries++) {
+		for (i = 0; i < LAUNCHLEN; i++)
+			if (launches[i].pid == pid)
+				return i;
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		if (!(f = fopen(path, "r")))
+			break;
+		p = fgets(buf, sizeof(buf), f);
+		fclose(f);
+		/* the ppid follows the state after the parenthesized comm */
+		if (!p || !(p = strrchr(buf, ')')) || sscanf(p, ") %*c %d", &pid) != 1)
+			break;
+	}
+	return -1;
+}
+
+void
+loadcursors(void *data)
+{
+	/* Reading the cursor theme from disk is the slowest part of startup
+	 * that nothing on screen depends on, so it waits for the first frame.
+	 * Outputs created from now on load their scale in createmon(). */
+	Monitor *m;
+	uint64_t t = nowns();
+
+	wl_list_for_each(m, &mons, link)
+		wlr_xcursor_manager_load(cursor_mgr, m->wlr_output->scale);
+	/* XWayland gets its cursor at scale 1 */
+	wlr_xcursor_manager_load(cursor_mgr, 1);
+	if (cursor_mode == CurNormal && !seat->pointer_state.focused_surface)
+		wlr_xcursor_manager_set_cursor_image(cursor_mgr, "left_ptr", cursor);
+	tracespan("cursor theme", t);
+	startupmark("cursor theme loaded");
+}
+
+void
+loopdone(void *data)
+{
+	/* Close the loop iteration opened by the first handler in it */
+	uint64_t now = nowns(), t;
+
+	/* our idle sources queued after this one still belong to it */
+#ifdef XWAYLAND
+	if (configidle) {
+		wl_event_loop_add_idle(wl_display_get_event_loop(dpy), loopdone, NULL);
+		return;
+	}
+#endif
+	if (stateidle) {
+		wl_event_loop_add_idle(wl_display_get_event_loop(dpy), loopdone, NULL);
+		return;
+	}
+	t = now - loopstart;
+
+	dispatchns += t;
+	loopiterations++;
+	if (stallms && t >= stallms * 1000000ULL) {
+		stalls++;
+		/* at most one line a second, stalls tend to come in bursts */
+		if (now - stalllogtime < 1000000000ULL) {
+			stallsunlogged++;
+		} else {
+			fprintf(stderr, "event loop stalled for %.1f ms, %.1f ms in %s"
+					" (%lu more since the last report)\n", t / 1e6,
+					slowestns / 1e6, slowest->name, stallsunlogged);
+			stalllogtime = now;
+			stallsunlogged = 0;
+		}
+	}
+	slowest = NULL;
+	slowestns = 0;
+	loopstart = 0;
+}
+
+void
+maplayersurfacenotify(struct wl_listener *listener, void *data)
+{
+	LayerSurface *layersurface = wl_container_of(listener, layersurface, map);
+	wlr_surface_send_enter(layersurface->layer_surface->surface, layersurface->layer_surface->output);
+	motionnotify(0);
+}
+
+void
+mapnotify(struct wl_listener *listener, void *data)
+{
+	/* Called when the surface is mapped, or ready to display on-screen. */
+	Client *c = wl_container_of(listener, c, map), *oldfocus = selclient();
+	int l;
+
+	if (client_is_unmanaged(c)) {
+		/* Insert this independent into independents lists. */
+		wl_list_insert(&independents, &c->link);
+#ifdef XWAYLAND
+		c->indepseq = ++indepclock;
+		placeindependent(c, 1);
+#endif
+		return;
+	}
+
+	/* Time from spawn() to the first window of the program */
+	if ((l = launchedby(client_get_pid(c))) >= 0) {
+		histadd(&launchmap, (nowns() - launches[l].time) / 1000);
+		launches[l].pid = 0;
+	}
+
+	ipcclientevent("map", c);
+
+	/* Insert this client into client lists. */
 	wl_list_insert(&clients, &c->link);
 	wl_list_insert(&fstack, &c->flink);
 	wl_list_insert(&stack, &c->slink);
+	c->st->focusseq = c->st->stackseq = ++seqclock;
 
-	client_get_geometry(c, &c->geom);
-	c->geom.width += 2 * c->bw;
-	c->geom.height += 2 * c->bw;
+#ifdef XWAYLAND
+	if (client_is_x11(c))
+		fetchsynccounter(c);
+#endif
+	client_get_geometry(c, &c->st->geom);
+	c->st->geom.width += 2 * c->st->bw;
+	c->st->geom.height += 2 * c->st->bw;
+	c->id = ++nextclientid;
+	record(RecMap, 0, c->id, c->st->geom.width, c->st->geom.height);
 
 	/* Set initial monitor, tags, floating status, and focus */
 	applyrules(c);
 
-	if (c->mon->fullscreenclient && c->mon->fullscreenclient == oldfocus
-			&& !c->isfloating && c->mon->lt[c->mon->sellt]->arrange) {
-		maximizeclient(c->mon->fullscreenclient);
-		focusclient(c->mon->fullscreenclient, 1);
+	if (c->st->mon->fullscreenclient && c->st->mon->fullscreenclient == oldfocus
+			&& !c->st->isfloating && c->st->mon->lt[c->st->mon->sellt]->arrange) {
+		maximizeclient(c->st->mon->fullscreenclient);
+		focusclient(c->st->mon->fullscreenclient, 1);
 		/* give the focus back the fullscreen client on that monitor if exists,
 		 * is focused and the new client isn't floating */
 	}
+	PROBE(mapnotify, c, c->st->geom.x, c->st->geom.y, c->st->geom.width,
+			c->st->geom.height, c->st->tags);
+}
+
+void
+matcheradd(Matcher *mt, const char *pat, unsigned int id)
+{
+	/* Add pat to the trie; NULL matches everything.  A leading ^ or a
+	 * trailing $ anchors it to the start or end of the text. */
+	MatchPat *p;
+	size_t len;
+	int node = 0, child;
+
+	if (mt->words < BITWORDS(id + 1)) {
+		if (!(mt->always = realloc(mt->always, BITWORDS(id + 1) * sizeof(*mt->always))))
+			EBARF("can't allocate rules");
+		memset(mt->always + mt->words, 0,
+				(BITWORDS(id + 1) - mt->words) * sizeof(*mt->always));
+		mt->words = BITWORDS(id + 1);
+	}
+	if (!pat) {
+		mt->always[id / ULBITS] |= 1UL << id % ULBITS;
+		return;
+	}
+
+	if (mt->npats == mt->patcap) {
+		mt->patcap = mt->patcap ? mt->patcap * 2 : 32;
+		if (!(mt->pats = realloc(mt->pats, mt->patcap * sizeof(*mt->pats))))
+			EBARF("can't allocate rules");
+	}
+	p = &mt->pats[mt->npats];
+	p->id = id;
+	if ((p->start = *pat == '^'))
+		pat++;
+	len = strlen(pat);
+	if ((p->end = len && pat[len - 1] == '$'))
+		len--;
+
+	if (!mt->nnodes)
+		matchnode(mt, -1, 0);
+	for (; len--; pat++, node = child)
+		if ((child = matchnext(mt, node, *pat)) < 0)
+			child = matchnode(mt, node, *pat);
+	p->next = mt->nodes[node].pats;
+	mt->nodes[node].pats = mt->npats++;
+}
+
+void
+matcherbuild(Matcher *mt)
+{
+	/* Fill in the fail and output links, breadth first so the links of
+	 * shorter prefixes are done before they are followed */
+	int *queue, head = 0, tail = 0, n, child, f;
+
+	if (!mt->nnodes)
+		matchnode(mt, -1, 0);
+	if (!mt->words && !(mt->always = calloc(mt->words = 1, sizeof(*mt->always))))
+		EBARF("can't allocate rules");
+	if (!(queue = malloc(mt->nnodes * sizeof(*queue))))
+		EBARF("can't allocate rules");
+	queue[tail++] = 0;
+	while (head < tail) {
+		n = queue[head++];
+		for (child = mt->nodes[n].child; child >= 0; child = mt->nodes[child].sibling) {
+			f = 0;
+			if (n) {
+				f = mt->nodes[n].fail;
+				while (f && matchnext(mt, f, mt->nodes[child].ch) < 0)
+					f = mt->nodes[f].fail;
+				if ((f = matchnext(mt, f, mt->nodes[child].ch)) < 0)
+					f = 0;
+			}
+			mt->nodes[child].fail = f;
+			mt->nodes[child].out = mt->nodes[f].pats >= 0 ? f : mt->nodes[f].out;
+			queue[tail++] = child;
+		}
+	}
+	free(queue);
+}
+
+void
+matcherrun(const Matcher *mt, const char *text, unsigned long *set)
+{
+	/* Set the bit of every id whose pattern occurs in text, in one pass */
+	size_t len = strlen(text), i;
+	const MatchPat *p;
+	int node = 0, n, next;
+
+	memcpy(set, mt->always, mt->words * sizeof(*set));
+	for (i = 0; i < len; i++) {
+		while ((next = matchnext(mt, node, text[i])) < 0 && node)
+			node = mt->nodes[node].fail;
+		node = next >= 0 ? next : 0;
+		for (n = mt->nodes[node].pats >= 0 ? node : mt->nodes[node].out; n > 0;
+				n = mt->nodes[n].out)
+			for (p = &mt->pats[mt->nodes[n].pats]; p;
+					p = p->next >= 0 ? &mt->pats[p->next] : NULL)
+				if ((!p->start || i + 1 == mt->nodes[n].depth)
+						&& (!p->end || i + 1 == len))
+					set[p->id / ULBITS] |= 1UL << p->id % ULBITS;
+	}
+	/* empty patterns: "", "^", "$" match anything, "^$" only "" */
+	for (p = mt->nodes[0].pats >= 0 ? &mt->pats[mt->nodes[0].pats] : NULL; p;
+			p = p->next >= 0 ? &mt->pats[p->next] : NULL)
+		if (!p->start || !p->end || !len)
+			set[p->id / ULBITS] |= 1UL << p->id % ULBITS;
+}
+
+int
+matchnext(const Matcher *mt, int node, unsigned char ch)
+{
+	int child;
+
+	child = mt->nodes[node].child;
+	while (child >= 0 && mt->nodes[child].ch != ch)
+		child = mt->nodes[child].sibling;
+	return child;
+}
+
+int
+matchnode(Matcher *mt, int parent, unsigned char ch)
+{
+	/* Append a trie node under parent, or the root if parent is -1 */
+	MatchNode *n;
+
+	if (mt->nnodes == mt->nodecap) {
+		mt->nodecap = mt->nodecap ? mt->nodecap * 2 : 64;
+		if (!(mt->nodes = realloc(mt->nodes, mt->nodecap * sizeof(*mt->nodes))))
+			EBARF("can't allocate rules");
+	}
+	n = &mt->nodes[mt->nnodes];
+	memset(n, 0, sizeof(*n));
+	n->ch = ch;
+	n->child = n->pats = n->out = -1;
+	n->sibling = -1;
+	if (parent >= 0) {
+		n->depth = mt->nodes[parent].depth + 1;
+		n->sibling = mt->nodes[parent].child;
+		mt->nodes[parent].child = mt->nnodes;
+	}
+	return mt->nnodes++;
 }
 
 void
@@ -1370,9 +2921,9 @@ monocle(Monitor *m)
 	Client *c;
 
 	wl_list_for_each(c, &clients, link) {
-		if (!VISIBLEON(c, m) || c->isfloating)
+		if (!VISIBLEON(c, m) || c->st->isfloating)
 			continue;
-		if (c->isfullscreen)
+		if (c->st->isfullscreen)
 			maximizeclient(c);
 		else
 			resize(c, m->w.x, m->w.y, m->w.width, m->w.height, 0);
@@ -1389,6 +2940,7 @@ motionabsolute(struct wl_listener *listener, void *data)
 	 * so we have to warp the mouse there. There is also some hardware which
 	 * emits these events. */
 	struct wlr_event_pointer_motion_absolute *event = data;
+	record(RecMotionAbsolute, 0, 0, event->x, event->y);
 	wlr_cursor_warp_absolute(cursor, event->device, event->x, event->y);
 	motionnotify(event->time_msec);
 }
@@ -1400,8 +2952,10 @@ motionnotify(uint32_t time)
 	struct wlr_surface *surface = NULL;
 	Client *c = NULL;
 
+	PROBE(motionnotify_entry, time, (int)cursor->x, (int)cursor->y);
 	// time is 0 in internal calls meant to restore pointer focus.
 	if (time) {
+		inputhandled(time);
 		wlr_idle_notify_activity(idle, seat);
 
 		/* Update selmon (even while dragging a window) */
@@ -1413,12 +2967,14 @@ motionnotify(uint32_t time)
 	if (cursor_mode == CurMove) {
 		/* Move the grabbed client to the new position. */
 		resize(grabc, cursor->x - grabcx, cursor->y - grabcy,
-				grabc->geom.width, grabc->geom.height, 1);
+				grabc->st->geom.width, grabc->st->geom.height, 1);
+		PROBE(motionnotify_return, grabc, NULL);
 		return;
 	} else if (cursor_mode == CurResize) {
-		resize(grabc, grabc->geom.x, grabc->geom.y,
-				cursor->x - grabc->geom.x,
-				cursor->y - grabc->geom.y, 1);
+		resize(grabc, grabc->st->geom.x, grabc->st->geom.y,
+				cursor->x - grabc->st->geom.x,
+				cursor->y - grabc->st->geom.y, 1);
+		PROBE(motionnotify_return, grabc, NULL);
 		return;
 	}
 
@@ -1432,15 +2988,15 @@ motionnotify(uint32_t time)
 	/* Find an independent under the pointer and send the event along. */
 	else if ((c = xytoindependent(cursor->x, cursor->y))) {
 		surface = wlr_surface_surface_at(c->surface.xwayland->surface,
-				cursor->x - c->surface.xwayland->x - c->bw,
-				cursor->y - c->surface.xwayland->y - c->bw, &sx, &sy);
+				cursor->x - c->surface.xwayland->x - c->st->bw,
+				cursor->y - c->surface.xwayland->y - c->st->bw, &sx, &sy);
 
 	/* Otherwise, find the client under the pointer and send the event along. */
 	}
 #endif
 	else if ((c = xytoclient(cursor->x, cursor->y))) {
-		surface = client_surface_at(c, cursor->x - c->geom.x - c->bw,
-				cursor->y - c->geom.y - c->bw, &sx, &sy);
+		surface = client_surface_at(c, cursor->x - c->st->geom.x - c->st->bw,
+				cursor->y - c->st->geom.y - c->st->bw, &sx, &sy);
 	}
 	else if ((surface = xytolayersurface(&selmon->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM],
 					cursor->x, cursor->y, &sx, &sy)))
@@ -1457,6 +3013,7 @@ motionnotify(uint32_t time)
 				"left_ptr", cursor);
 
 	pointerfocus(c, surface, sx, sy, time);
+	PROBE(motionnotify_return, c, surface);
 }
 
 void
@@ -1465,6 +3022,7 @@ motionrelative(struct wl_listener *listener, void *data)
 	/* This event is forwarded by the cursor when a pointer emits a _relative_
 	 * pointer motion event (i.e. a delta) */
 	struct wlr_event_pointer_motion *event = data;
+	record(RecMotion, 0, 0, event->delta_x, event->delta_y);
 	/* The cursor doesn't move unless we tell it to. The cursor automatically
 	 * handles constraining the motion to the output layout, as well as any
 	 * special configuration applied for the specific input device which
@@ -1486,22 +3044,30 @@ moveresize(const Arg *arg)
 	setfloating(grabc, 1);
 	switch (cursor_mode = arg->ui) {
 	case CurMove:
-		grabcx = cursor->x - grabc->geom.x;
-		grabcy = cursor->y - grabc->geom.y;
+		grabcx = cursor->x - grabc->st->geom.x;
+		grabcy = cursor->y - grabc->st->geom.y;
 		wlr_xcursor_manager_set_cursor_image(cursor_mgr, "fleur", cursor);
 		break;
 	case CurResize:
 		/* Doesn't work for X11 output - the next absolute motion event
 		 * returns the cursor to where it started */
 		wlr_cursor_warp_closest(cursor, NULL,
-				grabc->geom.x + grabc->geom.width,
-				grabc->geom.y + grabc->geom.height);
+				grabc->st->geom.x + grabc->st->geom.width,
+				grabc->st->geom.y + grabc->st->geom.height);
 		wlr_xcursor_manager_set_cursor_image(cursor_mgr,
 				"bottom_right_corner", cursor);
 		break;
 	}
 }
 
+uint64_t
+nowns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
 void
 outputmgrapply(struct wl_listener *listener, void *data)
 {
@@ -1563,6 +3129,54 @@ outputmgrtest(struct wl_listener *listener, void *data)
 	outputmgrapplyortest(config, 1);
 }
 
+void
+parsecpus(const char *list, cpu_set_t *set)
+{
+	/* Parse a CPU list like "0-1,4" */
+	int lo, hi, n;
+
+	CPU_ZERO(set);
+	while (*list) {
+		if (sscanf(list, "%d%n", &lo, &n) != 1)
+			BARF("bad CPU list: %s", list);
+		list += n;
+		hi = lo;
+		if (*list == '-' && sscanf(++list, "%d%n", &hi, &n) == 1)
+			list += n;
+		while (lo <= hi)
+			CPU_SET(lo++, set);
+		if (*list == ',')
+			list++;
+		else if (*list)
+			BARF("bad CPU list: %s", list);
+	}
+}
+
+void
+placeclient(Client *c)
+{
+	/* On the initial commit of a toplevel, before wlroots sends the first
+	 * configure, work out where mapnotify() will put it and ask for that
+	 * size, so the first buffer already fits.  The layout runs as if c
+	 * were mapped on top of the client list, with resize() configuring
+	 * only c and leaving every other client alone. */
+	unsigned int newtags;
+	Monitor *m = evalrules(c, &newtags);
+
+	if (!m || c->st->isfloating || !m->lt[m->sellt]->arrange)
+		return;
+	c->st->mon = m;
+	c->st->tags = newtags ? newtags : m->tagset[m->seltags];
+	c->st->isfullscreen = 0;
+	wl_list_insert(&clients, &c->link);
+	placing = c;
+	m->lt[m->sellt]->arrange(m);
+	placing = NULL;
+	wl_list_remove(&c->link);
+	/* unmapped clients have no monitor, see unmapnotify() */
+	c->st->mon = NULL;
+}
+
 void
 pointerfocus(Client *c, struct wlr_surface *surface, double sx, double sy,
 		uint32_t time)
@@ -1602,12 +3216,223 @@ pointerfocus(Client *c, struct wlr_surface *surface, double sx, double sy,
 		focusclient(c, 0);
 }
 
+void *
+poolalloc(Pool *p)
+{
+	char *slab, *obj;
+	size_t i;
+
+	if (!p->freelist) {
+		if (!(slab = malloc(POOLALIGN + POOLSLAB * p->size)))
+			EBARF("can't allocate %s", p->name);
+		*(void **)slab = p->slabs;
+		p->slabs = slab;
+		p->nslabs++;
+		/* hand out objects in address order */
+		for (i = POOLSLAB; i-- > 0;) {
+			obj = slab + POOLALIGN + i * p->size;
+			*(void **)obj = p->freelist;
+			p->freelist = obj;
+		}
+	}
+	obj = p->freelist;
+	p->freelist = *(void **)obj;
+	memset(obj, 0, p->size);
+	p->allocs++;
+	p->peak = MAX(p->peak, ++p->live);
+	return obj;
+}
+
+void
+poolfree(Pool *p, void *obj)
+{
+	/* LIFO, so the next allocation gets the most recently used memory */
+	*(void **)obj = p->freelist;
+	p->freelist = obj;
+	p->live--;
+}
+
+void
+presentmon(struct wl_listener *listener, void *data)
+{
+	/* The frame carrying a latency sample reached the screen */
+	Monitor *m = wl_container_of(listener, m, present);
+	struct wlr_output_event_present *event = data;
+	uint64_t when;
+
+	if (!m->latframe)
+		return;
+	when = event->when ? event->when->tv_sec * 1000000000ull
+		+ event->when->tv_nsec : nowns();
+	if (when > m->latinput && when - m->latinput < LATENCYMAX * 1000000ull)
+		histadd(&m->latency, (when - m->latinput) / 1000);
+	m->latinput = 0;
+	m->latframe = 0;
+}
+
+const char *
+promescape(const char *s)
+{
+	/* Quote a Prometheus label value; the result is valid until the next call */
+	static char buf[256];
+	size_t n = 0;
+
+	for (; *s && n < sizeof(buf) - 2; s++) {
+		if (*s == '\\' || *s == '"' || *s == '\n') {
+			buf[n++] = '\\';
+			buf[n++] = *s == '\n' ? 'n' : *s;
+		} else {
+			buf[n++] = *s;
+		}
+	}
+	buf[n] = '\0';
+	return buf;
+}
+
+void
+promsummary(FILE *out, const char *name, const char *labels, Hist *h)
+{
+	/* Write a histogram as a Prometheus summary, in seconds */
+	static const double q[] = { 0.5, 0.9, 0.99 };
+	size_t i;
+
+	for (i = 0; i < LENGTH(q); i++)
+		fprintf(out, "%s{%s,quantile=\"%g\"} %.6f\n", name, labels, q[i],
+				histpct(h, q[i]) / 1e6);
+	fprintf(out, "%s_sum{%s} %.6f\n", name, labels, h->sum / 1e6);
+	fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)h->n);
+}
+
+void
+publishstate(void *data)
+{
+	Client *sel = selclient();
+	ClientState *s;
+	Monitor *m;
+	uint32_t n = 0;
+	const char *str;
+
+	stateidle = NULL;
+	__atomic_store_n(&statepage->seq, statepage->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	wl_list_for_each(m, &mons, link) {
+		if (n == STATEMONS)
+			break;
+		snprintf(statepage->mons[n].name, sizeof(statepage->mons[n].name),
+				"%s", m->wlr_output->name);
+		statepage->mons[n].tags = m->tagset[m->seltags];
+		statepage->mons[n].occupied = 0;
+		for (s = cstate; s < cstate + ncstate; s++)
+			if (s->mon == m)
+				statepage->mons[n].occupied |= s->tags;
+		statepage->mons[n].urgent = 0;
+		statepage->mons[n].selected = m == selmon;
+		statepage->mons[n].nmaster = m->nmaster;
+		statepage->mons[n].mfact = m->mfact;
+		snprintf(statepage->mons[n].ltsymbol,
+				sizeof(statepage->mons[n].ltsymbol),
+				"%s", m->lt[m->sellt]->symbol);
+		n++;
+	}
+	statepage->nmons = n;
+	str = sel ? client_get_title(sel) : NULL;
+	snprintf(statepage->title, sizeof(statepage->title), "%s", str ? str : "");
+	str = sel ? client_get_appid(sel) : NULL;
+	snprintf(statepage->appid, sizeof(statepage->appid), "%s", str ? str : "");
+
+	__atomic_store_n(&statepage->seq, statepage->seq + 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &statepage->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
 void
 quit(const Arg *arg)
 {
 	wl_display_terminate(dpy);
 }
 
+int
+reapchildren(int signo, void *data)
+{
+	/* SIGCHLD arrives through a signalfd on the event loop */
+	while (0 < waitpid(-1, NULL, WNOHANG))
+		;
+	return 0;
+}
+
+void
+reapplyrules(Client *c, const unsigned long *match)
+{
+	/* Only the rules c did not match before are applied, so the floating
+	 * state, tags and monitor given by older rules or by the user stay */
+	unsigned long fresh;
+	unsigned int i, n, newtags = 0;
+	int changed = 0;
+	const Rule *r;
+	Monitor *mon = c->st->mon, *m;
+
+	for (i = 0; i < BITWORDS(LENGTH(rules)); i++) {
+		fresh = match[i] & ~c->matched[i];
+		c->matched[i] = match[i];
+		while (fresh) {
+			r = &rules[i * ULBITS + __builtin_ctzl(fresh)];
+			fresh &= fresh - 1;
+			c->st->isfloating = r->isfloating;
+			newtags |= r->tags;
+			n = 0;
+			wl_list_for_each(m, &mons, link)
+				if (r->monitor == n++)
+					mon = m;
+			changed = 1;
+		}
+	}
+	if (mon != c->st->mon) {
+		setmon(c, mon, newtags);
+	} else if (changed) {
+		if (newtags)
+			c->st->tags = newtags;
+		arrange(mon);
+		/* as tag() does, c may have left the visible tags */
+		if (newtags)
+			focusclient(focustop(selmon), 1);
+	}
+}
+
+void
+record(int type, unsigned int a, uint32_t b, float x, float y)
+{
+	Record r;
+
+	livecounts[type]++;
+	if (!recordfp)
+		return;
+	r.msec = (nowns() - recordstart) / 1000000;
+	r.type = type;
+	r.a = a;
+	r.b = b;
+	r.x = x;
+	r.y = y;
+	fwrite(&r, sizeof(r), 1, recordfp);
+}
+
+void
+registerclient(Client *c)
+{
+	size_t i;
+
+	if (ncstate == cstatecap) {
+		cstatecap = cstatecap ? cstatecap * 2 : 32;
+		if (!(cstate = realloc(cstate, cstatecap * sizeof(*cstate)))
+				|| !(cdrawn = realloc(cdrawn, cstatecap * sizeof(*cdrawn))))
+			EBARF("can't allocate client state");
+		for (i = 0; i < ncstate; i++)
+			cstate[i].c->st = &cstate[i];
+	}
+	c->st = &cstate[ncstate++];
+	memset(c->st, 0, sizeof(*c->st));
+	c->st->c = c;
+}
+
 void
 render(struct wlr_surface *surface, int sx, int sy, void *data)
 {
@@ -1670,33 +3495,40 @@ void
 renderclients(Monitor *m, struct timespec *now)
 {
 	Client *c, *sel = selclient();
+	ClientState *s;
 	const float *color;
 	double ox, oy;
 	int i, w, h;
+	size_t j, n = 0;
 	struct render_data rdata;
 	struct wlr_box *borders;
 	struct wlr_surface *surface;
-	/* Each subsequent window we render is rendered on top of the last. Because
-	 * our stacking list is ordered front-to-back, we iterate over it backwards. */
-	wl_list_for_each_reverse(c, &stack, slink) {
-		/* Only render visible clients which show on this monitor */
-		if (!VISIBLEON(c, c->mon) || !wlr_output_layout_intersects(
-					output_layout, m->wlr_output, &c->geom))
-			continue;
 
+	/* Only render visible clients which show on this monitor */
+	for (s = cstate; s < cstate + ncstate; s++)
+		if (s->mon && ISVISIBLE(s, s->mon) && wlr_output_layout_intersects(
+					output_layout, m->wlr_output, &s->geom))
+			cdrawn[n++] = s;
+
+	/* Each subsequent window we render is rendered on top of the last, so
+	 * go from the bottom of the stacking order up. */
+	qsort(cdrawn, n, sizeof(*cdrawn), stackcmp);
+	for (j = 0; j < n; j++) {
+		s = cdrawn[j];
+		c = s->c;
 		surface = client_surface(c);
-		ox = c->geom.x, oy = c->geom.y;
+		ox = s->geom.x, oy = s->geom.y;
 		wlr_output_layout_output_coords(output_layout, m->wlr_output,
 				&ox, &oy);
 
-		if (c->bw) {
+		if (s->bw) {
 			w = surface->current.width;
 			h = surface->current.height;
 			borders = (struct wlr_box[4]) {
-				{ox, oy, w + 2 * c->bw, c->bw},             /* top */
-				{ox, oy + c->bw, c->bw, h},                 /* left */
-				{ox + c->bw + w, oy + c->bw, c->bw, h},     /* right */
-				{ox, oy + c->bw + h, w + 2 * c->bw, c->bw}, /* bottom */
+				{ox, oy, w + 2 * s->bw, s->bw},             /* top */
+				{ox, oy + s->bw, s->bw, h},                 /* left */
+				{ox + s->bw + w, oy + s->bw, s->bw, h},     /* right */
+				{ox, oy + s->bw + h, w + 2 * s->bw, s->bw}, /* bottom */
 			};
 
 			/* Draw window borders */
@@ -1712,8 +3544,8 @@ renderclients(Monitor *m, struct timespec *now)
 		 * xdg_surface's toplevel and popups. */
 		rdata.output = m->wlr_output;
 		rdata.when = now;
-		rdata.x = c->geom.x + c->bw;
-		rdata.y = c->geom.y + c->bw;
+		rdata.x = s->geom.x + s->bw;
+		rdata.y = s->geom.y + s->bw;
 		client_for_each_surface(c, render, &rdata);
 	}
 }
@@ -1738,8 +3570,9 @@ renderlayer(struct wl_list *layer_surfaces, struct timespec *now)
 void
 rendermon(struct wl_listener *listener, void *data)
 {
-	Client *c;
-	int render = 1;
+	ClientState *s;
+	int render = 1, committed;
+	uint64_t t;
 
 	/* This function is called every time an output is ready to display a frame,
 	 * generally at the output's refresh rate (e.g. 60Hz). */
@@ -1747,32 +3580,51 @@ rendermon(struct wl_listener *listener, void *data)
 
 	struct timespec now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
+	PROBE(rendermon_entry, m);
 
-	/* Do not render if any XDG clients have an outstanding resize. */
-	wl_list_for_each(c, &stack, slink) {
-		if (c->resize) {
-			wlr_surface_send_frame_done(client_surface(c), &now);
+	/* Do not render if any clients have an outstanding resize.  X11
+	 * clients get synctimeout ms to update their sync counter. */
+	for (s = cstate; s < cstate + ncstate; s++) {
+#ifdef XWAYLAND
+		if (s->resize && client_is_x11(s->c)
+				&& nowns() - s->c->configuretime > synctimeout * 1000000ULL) {
+			s->resize = 0;
+			synctimeouts++;
+		}
+#endif
+		if (s->resize) {
+			wlr_surface_send_frame_done(client_surface(s->c), &now);
 			render = 0;
 		}
 	}
 
 	/* wlr_output_attach_render makes the OpenGL context current. */
-	if (!wlr_output_attach_render(m->wlr_output, NULL))
+	if (!wlr_output_attach_render(m->wlr_output, NULL)) {
+		PROBE(rendermon_return, m, 0, 0);
 		return;
+	}
 
 	if (render) {
 		/* Begin the renderer (calls glViewport and some other GL sanity checks) */
+		t = nowns();
 		wlr_renderer_begin(drw, m->wlr_output->width, m->wlr_output->height);
 		wlr_renderer_clear(drw, rootcolor);
 
 		renderlayer(&m->layers[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND], &now);
 		renderlayer(&m->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM], &now);
+		tracespan("render layers below", t);
+		t = nowns();
 		renderclients(m, &now);
+		tracespan("render clients", t);
 #ifdef XWAYLAND
-		renderindependents(m->wlr_output, &now);
+		t = nowns();
+		renderindependents(m, &now);
+		tracespan("render independents", t);
 #endif
+		t = nowns();
 		renderlayer(&m->layers[ZWLR_LAYER_SHELL_V1_LAYER_TOP], &now);
 		renderlayer(&m->layers[ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY], &now);
+		tracespan("render layers above", t);
 
 		/* Hardware cursors are rendered by the GPU on a separate plane, and can be
 		 * moved around without re-rendering what's beneath them - which is more
@@ -1787,7 +3639,99 @@ rendermon(struct wl_listener *listener, void *data)
 		wlr_renderer_end(drw);
 	}
 
-	wlr_output_commit(m->wlr_output);
+	t = nowns();
+	committed = wlr_output_commit(m->wlr_output);
+	tracespan("output commit", t);
+	if (committed && !render) {
+		m->skipped++;
+	} else if (committed) {
+		m->frames++;
+		if (m->latinput)
+			m->latframe = 1;
+	}
+	if (committed && !m->firstframe) {
+		m->firstframe = 1;
+		startupmark("first frame on %s", m->wlr_output->name);
+		if (!cursorsloaded)
+			wl_event_loop_add_idle(wl_display_get_event_loop(dpy),
+					loadcursorstraced, NULL);
+		cursorsloaded = 1;
+	}
+	PROBE(rendermon_return, m, render, committed);
+}
+
+void
+replay(const Record *r)
+{
+	/* Feed a recorded input event through the fake devices, so it takes
+	 * the same path through wlr_cursor and the handlers as the original */
+	uint32_t time = nowns() / 1000000;
+	struct wlr_event_keyboard_key key = {
+		.time_msec = time, .keycode = r->b, .update_state = true, .state = r->a,
+	};
+	struct wlr_event_pointer_button button = {
+		.device = replayptr, .time_msec = time, .button = r->b, .state = r->a,
+	};
+	struct wlr_event_pointer_motion motion = {
+		.device = replayptr, .time_msec = time, .delta_x = r->x,
+		.delta_y = r->y, .unaccel_dx = r->x, .unaccel_dy = r->y,
+	};
+	struct wlr_event_pointer_motion_absolute absolute = {
+		.device = replayptr, .time_msec = time, .x = r->x, .y = r->y,
+	};
+	struct wlr_event_pointer_axis axis = {
+		.device = replayptr, .time_msec = time, .orientation = r->a & 0xff,
+		.source = r->a >> 8, .delta = r->y, .delta_discrete = (int32_t)r->b,
+	};
+
+	switch (r->type) {
+	case RecKey:
+		wlr_keyboard_notify_key(replaykbd->keyboard, &key);
+		return;
+	case RecButton:
+		wl_signal_emit(&replayptr->pointer->events.button, &button);
+		break;
+	case RecMotion:
+		wl_signal_emit(&replayptr->pointer->events.motion, &motion);
+		break;
+	case RecMotionAbsolute:
+		wl_signal_emit(&replayptr->pointer->events.motion_absolute, &absolute);
+		break;
+	case RecAxis:
+		wl_signal_emit(&replayptr->pointer->events.axis, &axis);
+		break;
+	default:
+		/* client actions are up to the clients; count them to compare */
+		if (r->type < RecLast)
+			logcounts[r->type]++;
+		return;
+	}
+	wl_signal_emit(&replayptr->pointer->events.frame, replayptr->pointer);
+}
+
+int
+replaynext(void *data)
+{
+	uint64_t now = (nowns() - replaystart) / 1000000;
+
+	while (replaypending || fread(&replayrec, sizeof(replayrec), 1, replayfp) == 1) {
+		if (replayrec.msec > now) {
+			replaypending = 1;
+			wl_event_source_timer_update(replaytimer, replayrec.msec - now);
+			return 0;
+		}
+		replaypending = 0;
+		replay(&replayrec);
+	}
+
+	fprintf(stderr, "replay done: maps %lu/%lu, unmaps %lu/%lu, size commits %lu/%lu, "
+			"fullscreen requests %lu/%lu (log/this run)\n",
+			logcounts[RecMap], livecounts[RecMap],
+			logcounts[RecUnmap], livecounts[RecUnmap],
+			logcounts[RecCommit], livecounts[RecCommit],
+			logcounts[RecFullscreen], livecounts[RecFullscreen]);
+	wl_display_terminate(dpy);
+	return 0;
 }
 
 void
@@ -1798,31 +3742,69 @@ resize(Client *c, int x, int y, int w, int h, int interact)
 	 * compositor, you'd wait for the client to prepare a buffer at
 	 * the new size, then commit any movement that was prepared.
 	 */
-	struct wlr_box *bbox = interact ? &sgeom : &c->mon->w;
-	c->geom.x = x;
-	c->geom.y = y;
-	c->geom.width = w;
-	c->geom.height = h;
+	struct wlr_box *bbox = interact ? &sgeom : &c->st->mon->w;
+	uint32_t serial;
+	if (placing && c != placing)
+		return;
+	PROBE(resize_entry, c, x, y, w, h, interact);
+	c->st->geom.x = x;
+	c->st->geom.y = y;
+	c->st->geom.width = w;
+	c->st->geom.height = h;
 	applybounds(c, bbox);
-	/* wlroots makes this a no-op if size hasn't changed */
-	c->resize = client_set_size(c, c->geom.width - 2 * c->bw,
-			c->geom.height - 2 * c->bw);
+	/* wlroots makes this a no-op if size hasn't changed, and merges it
+	 * into a configure that is scheduled but not yet sent */
+	serial = client_set_size(c, c->st->geom.width - 2 * c->st->bw,
+			c->st->geom.height - 2 * c->st->bw);
+	if (c == placing) {
+		/* nothing on screen to hold frames for yet */
+		PROBE(resize_return, c, c->st->geom.x, c->st->geom.y,
+				c->st->geom.width, c->st->geom.height, 0);
+		return;
+	}
+	if (serial && serial == c->st->resize) {
+		appstats(c)->coalesced++;
+	} else if (serial) {
+		appstats(c)->sent++;
+		c->configuretime = nowns();
+		c->acktime = 0;
+	}
+	c->st->resize = serial;
+	PROBE(resize_return, c, c->st->geom.x, c->st->geom.y, c->st->geom.width,
+			c->st->geom.height, serial);
 }
 
 void
-run(char *startup_cmd)
+rulematch(Client *c, unsigned long *match)
+{
+	/* Set the rules matching both app_id and title of c */
+	unsigned long title[BITWORDS(LENGTH(rules))];
+	const char *s;
+	size_t i;
+
+	matcherrun(&idmatcher, (s = client_get_appid(c)) ? s : broken, match);
+	matcherrun(&titlematcher, (s = client_get_title(c)) ? s : broken, title);
+	for (i = 0; i < LENGTH(title); i++)
+		match[i] &= title[i];
+}
+
+void
+run(char *startup_cmd, char *recordpath)
 {
 	pid_t startup_pid = -1;
+	struct wl_event_loop *loop = wl_display_get_event_loop(dpy);
 
 	/* Add a Unix socket to the Wayland display. */
 	const char *socket = wl_display_add_socket_auto(dpy);
 	if (!socket)
 		BARF("startup: display_add_socket_auto");
+	startupmark("socket %s ready", socket);
 
 	/* Start the backend. This will enumerate outputs and inputs, become the DRM
 	 * master, etc */
 	if (!wlr_backend_start(backend))
 		BARF("startup: backend_start");
+	startupmark("backend started");
 
 	/* Now that outputs are initialized, choose initial selmon based on
 	 * cursor position, and set default cursor image */
@@ -1835,24 +3817,37 @@ run(char *startup_cmd)
 	wlr_cursor_warp_closest(cursor, NULL, cursor->x, cursor->y);
 	wlr_xcursor_manager_set_cursor_image(cursor_mgr, "left_ptr", cursor);
 
+	if (recordpath) {
+		if (!(recordfp = fopen(recordpath, "w")))
+			EBARF("startup: can't open %s", recordpath);
+		fwrite("dwlrec1", 8, 1, recordfp);
+		fwrite((uint32_t [2]){ selmon ? selmon->m.width : 0,
+				selmon ? selmon->m.height : 0 }, sizeof(uint32_t), 2, recordfp);
+		recordstart = nowns();
+	}
+	if (replayfp) {
+		replaytimer = wl_event_loop_add_timer(loop, replaynexttraced, NULL);
+		replaystart = nowns();
+		wl_event_source_timer_update(replaytimer, 1);
+	}
+
 	/* Set the WAYLAND_DISPLAY environment variable to our socket and run the
 	 * startup command if requested. */
 	setenv("WAYLAND_DISPLAY", socket, 1);
+	setupipc(socket);
 
 	if (startup_cmd) {
-		startup_pid = fork();
+		startup_pid = launch((char *[]){ "/bin/sh", "-c", startup_cmd, NULL }, 0);
 		if (startup_pid < 0)
-			EBARF("startup: fork");
-		if (startup_pid == 0) {
-			execl("/bin/sh", "/bin/sh", "-c", startup_cmd, NULL);
-			EBARF("startup: execl");
-		}
+			BARF("startup: spawn failed");
 	}
 
 	/* Run the Wayland event loop. This does not return until you exit the
 	 * compositor. Starting the backend rigged up all of the necessary event
 	 * loop configuration to listen to libinput events, DRM events, generate
 	 * frame events at the refresh rate, and so on. */
+	if (loopstart)
+		loopstart = nowns(); /* startup is not a stalled iteration */
 	wl_display_run(dpy);
 
 	if (startup_cmd) {
@@ -1901,8 +3896,8 @@ setcursor(struct wl_listener *listener, void *data)
 void
 setfloating(Client *c, int floating)
 {
-	c->isfloating = floating;
-	arrange(c->mon);
+	c->st->isfloating = floating;
+	arrange(c->st->mon);
 }
 
 void
@@ -1914,6 +3909,8 @@ setlayout(const Arg *arg)
 		selmon->lt[selmon->sellt] = (Layout *)arg->v;
 	/* TODO change layout symbol? */
 	arrange(selmon);
+	ipcevent("layout\t%s\t%s", selmon->wlr_output->name,
+			selmon->lt[selmon->sellt]->symbol);
 }
 
 /* arg > 1.0 will set mfact absolutely */
@@ -1934,11 +3931,11 @@ setmfact(const Arg *arg)
 void
 setmon(Client *c, Monitor *m, unsigned int newtags)
 {
-	Monitor *oldmon = c->mon;
+	Monitor *oldmon = c->st->mon;
 
 	if (oldmon == m)
 		return;
-	c->mon = m;
+	c->st->mon = m;
 
 	/* TODO leave/enter is not optimal but works */
 	if (oldmon) {
@@ -1949,12 +3946,54 @@ setmon(Client *c, Monitor *m, unsigned int newtags)
 		/* Make sure window actually overlaps with the monitor */
 		applybounds(c, &m->m);
 		wlr_surface_send_enter(client_surface(c), m->wlr_output);
-		c->tags = newtags ? newtags : m->tagset[m->seltags]; /* assign tags of target monitor */
+		c->st->tags = newtags ? newtags : m->tagset[m->seltags]; /* assign tags of target monitor */
 		arrange(m);
 	}
 	focusclient(focustop(selmon), 1);
 }
 
+void
+setplacement(void)
+{
+	/* Keep the main loop on its own cores; launch() moves children to
+	 * clientcpus, or back to the mask dwl started with, and into
+	 * clientcgroup. */
+	char path[256];
+	FILE *f;
+	int i, err;
+	const char *weight[] = { "cpu.weight", "io.weight" };
+	const int value[] = { clientcpuweight, clientioweight };
+
+	sched_getaffinity(0, sizeof(compositormask), &compositormask);
+	clientmask = compositormask;
+	if (compositorcpus) {
+		parsecpus(compositorcpus, &compositormask);
+		if (sched_setaffinity(0, sizeof(compositormask), &compositormask) < 0)
+			EBARF("can't pin compositor to %s", compositorcpus);
+	}
+	if (clientcpus)
+		parsecpus(clientcpus, &clientmask);
+	if (!clientcgroup)
+		return;
+
+	if (mkdir(clientcgroup, 0755) < 0 && errno != EEXIST)
+		EBARF("can't create %s", clientcgroup);
+	for (i = 0; i < LENGTH(weight); i++) {
+		if (!value[i])
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", clientcgroup, weight[i]);
+		err = !(f = fopen(path, "w"));
+		if (f) {
+			err = fprintf(f, "%d\n", value[i]) < 0;
+			err |= fclose(f) != 0;
+		}
+		if (err)
+			fprintf(stderr, "can't set %s, continuing without it\n", path);
+	}
+	if ((cgroupfd = open(clientcgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		EBARF("can't open %s", clientcgroup);
+}
+
 void
 setpsel(struct wl_listener *listener, void *data)
 {
@@ -1966,6 +4005,37 @@ setpsel(struct wl_listener *listener, void *data)
 	wlr_seat_set_primary_selection(seat, event->source, event->serial);
 }
 
+void
+setrealtime(void)
+{
+	/* SCHED_RESET_ON_FORK makes children started by spawn() and the startup
+	 * command fall back to SCHED_OTHER, and memory locks are never
+	 * inherited, so nothing needs undoing before exec. */
+	struct sched_param param = {.sched_priority = rtpriority};
+	volatile char *heap;
+	size_t i;
+
+	if (rtpriority && sched_setscheduler(0, SCHED_RR | SCHED_RESET_ON_FORK, &param) < 0)
+		perror("real-time scheduling not permitted, continuing without it");
+	if (!lockmemory)
+		return;
+
+	/* Keep freed memory in the heap so the pages faulted in below stay
+	 * resident and later allocations don't page-fault. */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	if ((heap = malloc(prefaultheap))) {
+		for (i = 0; i < prefaultheap; i += 4096)
+			heap[i] = 0;
+		free((char *)heap);
+	}
+	/* Lock only what is mapped now: dwl's code, stack and heap.  Without
+	 * MCL_FUTURE the client shm pools wlroots maps later stay pageable,
+	 * and MCL_ONFAULT leaves untouched parts of libraries alone. */
+	if (mlockall(MCL_CURRENT | MCL_ONFAULT) < 0)
+		perror("mlockall failed, continuing without locked memory");
+}
+
 void
 setsel(struct wl_listener *listener, void *data)
 {
@@ -1980,12 +4050,27 @@ setsel(struct wl_listener *listener, void *data)
 void
 setup(void)
 {
+	char magic[8];
+	uint32_t size[2];
+
+	/* Raise priority and pin the main loop first so every thread we start
+	 * inherits it */
+	setrealtime();
+	setplacement();
+	setupstate();
+	compilerules();
+
 	/* The Wayland display is managed by libwayland. It handles accepting
 	 * clients from the Unix socket, manging Wayland globals, and so on. */
 	dpy = wl_display_create();
 
 	/* clean up child processes immediately */
-	sigchld(0);
+	wl_event_loop_add_signal(wl_display_get_event_loop(dpy), SIGCHLD,
+			reapchildrentraced, NULL);
+	/* not SIGUSR1: wlroots waits for that from XWayland on its own
+	 * signalfd, and both sources would fire on either signal */
+	wl_event_loop_add_signal(wl_display_get_event_loop(dpy), SIGUSR2,
+			tracesignaltraced, NULL);
 
 	/* The backend is a wlroots feature which abstracts the underlying input and
 	 * output hardware. The autocreate option will choose the most suitable
@@ -1995,8 +4080,24 @@ setup(void)
 	 * backend uses the renderer, for example, to fall back to software cursors
 	 * if the backend does not support hardware cursors (some older GPUs
 	 * don't). */
-	if (!(backend = wlr_backend_autocreate(dpy)))
+	if (replayfp) {
+		/* One output the size of the recorded one, and a keyboard and a
+		 * pointer to replay into */
+		if (fread(magic, sizeof(magic), 1, replayfp) != 1
+				|| memcmp(magic, "dwlrec1", 8)
+				|| fread(size, sizeof(size[0]), 2, replayfp) != 2)
+			BARF("startup: not a dwl recording");
+		if (!(backend = wlr_headless_backend_create(dpy, NULL)))
+			BARF("couldn't create backend");
+		wlr_headless_add_output(backend, size[0] ? size[0] : 1280,
+				size[1] ? size[1] : 720);
+		replaykbd = wlr_headless_add_input_device(backend,
+				WLR_INPUT_DEVICE_KEYBOARD);
+		replayptr = wlr_headless_add_input_device(backend,
+				WLR_INPUT_DEVICE_POINTER);
+	} else if (!(backend = wlr_backend_autocreate(dpy))) {
 		BARF("couldn't create backend");
+	}
 
 	/* If we don't provide a renderer, autocreate makes a GLES2 renderer for us.
 	 * The renderer is responsible for defining the various pixel formats it
@@ -2040,6 +4141,7 @@ setup(void)
 	wl_list_init(&fstack);
 	wl_list_init(&stack);
 	wl_list_init(&independents);
+	wl_list_init(&ipcclients);
 
 	idle = wlr_idle_create(dpy);
 
@@ -2063,7 +4165,8 @@ setup(void)
 	/* Creates an xcursor manager, another wlroots utility which loads up
 	 * Xcursor themes to source cursor images from and makes sure that cursor
 	 * images are available at all scale factors on the screen (necessary for
-	 * HiDPI support). Scaled cursors will be loaded with each output. */
+	 * HiDPI support). Themes are loaded by loadcursors() after the first
+	 * frame. */
 	cursor_mgr = wlr_xcursor_manager_create(NULL, 24);
 
 	/*
@@ -2110,25 +4213,22 @@ setup(void)
 #ifdef XWAYLAND
 	/*
 	 * Initialise the XWayland X server.
-	 * It will be started when the first X client is started.
+	 * It will be started when the first X client is started, unless
+	 * xwaylandmode asks for it earlier.
 	 */
-	xwayland = wlr_xwayland_create(dpy, compositor, 1);
+	wl_list_init(&configqueue);
+	xwayland = wlr_xwayland_create(dpy, compositor, xwaylandmode != XWaylandEager);
 	if (xwayland) {
+		if (xwaylandmode == XWaylandEager)
+			xwaylandspawn = nowns();
+		if (xwaylandmode == XWaylandIdle) {
+			xwaylandtimer = wl_event_loop_add_timer(wl_display_get_event_loop(dpy),
+					wakexwaylandtraced, NULL);
+			wl_event_source_timer_update(xwaylandtimer, MAX(xwaylandidle, 1));
+		}
 		wl_signal_add(&xwayland->events.ready, &xwayland_ready);
 		wl_signal_add(&xwayland->events.new_surface, &new_xwayland_surface);
 
-		/*
-		 * Create the XWayland cursor manager at scale 1, setting its default
-		 * pointer to match the rest of dwl.
-		 */
-		xcursor_mgr = wlr_xcursor_manager_create(NULL, 24);
-		wlr_xcursor_manager_load(xcursor_mgr, 1);
-		if ((xcursor = wlr_xcursor_manager_get_xcursor(xcursor_mgr, "left_ptr", 1)))
-			wlr_xwayland_set_cursor(xwayland,
-					xcursor->images[0]->buffer, xcursor->images[0]->width * 4,
-					xcursor->images[0]->width, xcursor->images[0]->height,
-					xcursor->images[0]->hotspot_x, xcursor->images[0]->hotspot_y);
-
 		setenv("DISPLAY", xwayland->display_name, 1);
 	} else {
 		fprintf(stderr, "failed to setup XWayland X server, continuing without it\n");
@@ -2137,22 +4237,83 @@ setup(void)
 }
 
 void
-sigchld(int unused)
+setupipc(const char *display)
 {
-	if (signal(SIGCHLD, sigchld) == SIG_ERR)
-		EBARF("can't install SIGCHLD handler");
-	while (0 < waitpid(-1, NULL, WNOHANG))
-		;
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if (!dir)
+		return;
+	ipcaddr.sun_family = AF_UNIX;
+	if (snprintf(ipcaddr.sun_path, sizeof(ipcaddr.sun_path), "%s/dwl-%s.sock",
+				dir, display) >= (int)sizeof(ipcaddr.sun_path))
+		BARF("startup: control socket path too long");
+	unlink(ipcaddr.sun_path);
+	if ((ipcfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0
+			|| bind(ipcfd, (struct sockaddr *)&ipcaddr, sizeof(ipcaddr)) < 0
+			|| listen(ipcfd, 8) < 0)
+		EBARF("startup: control socket");
+	ipcsource = wl_event_loop_add_fd(wl_display_get_event_loop(dpy), ipcfd,
+			WL_EVENT_READABLE, ipcaccepttraced, NULL);
+	setenv("DWL_SOCK", ipcaddr.sun_path, 1);
+}
+
+void
+setupstate(void)
+{
+	char path[64];
+	int fd, sealed = 0;
+
+	/* Readers open it through /proc, so no program we start needs to
+	 * inherit the descriptor and be able to truncate it under us. */
+	if ((fd = memfd_create("dwl-state", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0
+			|| ftruncate(fd, sizeof(StatePage)) < 0)
+		EBARF("can't create state page");
+	statepage = mmap(NULL, sizeof(StatePage), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (statepage == MAP_FAILED)
+		EBARF("can't map state page");
+	/* a fixed size keeps publishstate() safe from SIGBUS; kernels before
+	 * 5.1 reject F_SEAL_FUTURE_WRITE and with it the whole call */
+#ifdef F_SEAL_FUTURE_WRITE
+	sealed = fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE) == 0;
+#endif
+	if (!sealed && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0)
+		EBARF("can't seal state page");
+	snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)getpid(), fd);
+	setenv("DWL_STATE", path, 1);
 }
 
 void
 spawn(const Arg *arg)
 {
-	if (fork() == 0) {
-		setsid();
-		execvp(((char **)arg->v)[0], (char **)arg->v);
-		EBARF("dwl: execvp %s failed", ((char **)arg->v)[0]);
-	}
+	launch((char *const *)arg->v, 1);
+}
+
+void
+startupmark(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "startup: %8.2f ms ", (nowns() - startuptime) / 1e6);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+void
+statechanged(void)
+{
+	if (!stateidle)
+		stateidle = wl_event_loop_add_idle(wl_display_get_event_loop(dpy),
+				publishstatetraced, NULL);
+}
+
+int
+stackcmp(const void *a, const void *b)
+{
+	const ClientState *sa = *(ClientState *const *)a, *sb = *(ClientState *const *)b;
+	return (sa->stackseq > sb->stackseq) - (sa->stackseq < sb->stackseq);
 }
 
 void
@@ -2160,7 +4321,7 @@ tag(const Arg *arg)
 {
 	Client *sel = selclient();
 	if (sel && arg->ui & TAGMASK) {
-		sel->tags = arg->ui & TAGMASK;
+		sel->st->tags = arg->ui & TAGMASK;
 		focusclient(focustop(selmon), 1);
 		arrange(selmon);
 	}
@@ -2180,9 +4341,10 @@ tile(Monitor *m)
 {
 	unsigned int i, n = 0, h, mw, my, ty;
 	Client *c;
+	ClientState *s;
 
-	wl_list_for_each(c, &clients, link)
-		if (VISIBLEON(c, m) && !c->isfloating)
+	for (s = cstate; s < cstate + ncstate; s++)
+		if (ISVISIBLE(s, m) && !s->isfloating)
 			n++;
 	if (n == 0)
 		return;
@@ -2193,18 +4355,18 @@ tile(Monitor *m)
 		mw = m->w.width;
 	i = my = ty = 0;
 	wl_list_for_each(c, &clients, link) {
-		if (!VISIBLEON(c, m) || c->isfloating)
+		if (!VISIBLEON(c, m) || c->st->isfloating)
 			continue;
-		if (c->isfullscreen)
+		if (c->st->isfullscreen)
 			maximizeclient(c);
 		else if (i < m->nmaster) {
 			h = (m->w.height - my) / (MIN(n, m->nmaster) - i);
 			resize(c, m->w.x, m->w.y + my, mw, h, 0);
-			my += c->geom.height;
+			my += c->st->geom.height;
 		} else {
 			h = (m->w.height - ty) / (n - i);
 			resize(c, m->w.x + mw, m->w.y + ty, m->w.width - mw, h, 0);
-			ty += c->geom.height;
+			ty += c->st->geom.height;
 		}
 		i++;
 	}
@@ -2217,7 +4379,7 @@ togglefloating(const Arg *arg)
 	if (!sel)
 		return;
 	/* return if fullscreen */
-	setfloating(sel, !sel->isfloating /* || sel->isfixed */);
+	setfloating(sel, !sel->st->isfloating /* || sel->isfixed */);
 }
 
 void
@@ -2227,9 +4389,9 @@ toggletag(const Arg *arg)
 	Client *sel = selclient();
 	if (!sel)
 		return;
-	newtags = sel->tags ^ (arg->ui & TAGMASK);
+	newtags = sel->st->tags ^ (arg->ui & TAGMASK);
 	if (newtags) {
-		sel->tags = newtags;
+		sel->st->tags = newtags;
 		focusclient(focustop(selmon), 1);
 		arrange(selmon);
 	}
@@ -2244,9 +4406,31 @@ toggleview(const Arg *arg)
 		selmon->tagset[selmon->seltags] = newtagset;
 		focusclient(focustop(selmon), 1);
 		arrange(selmon);
+		ipcevent("tags\t%s\t%u", selmon->wlr_output->name, newtagset);
 	}
 }
 
+int
+tracesignal(int signo, void *data)
+{
+	char path[256];
+
+	if (writetrace(path, sizeof(path)) < 0)
+		fprintf(stderr, "can't write trace: %s\n", strerror(errno));
+	else
+		fprintf(stderr, "trace written to %s\n", path);
+	return 0;
+}
+
+uint64_t
+tracespan(const char *name, uint64_t start)
+{
+	Span *sp = &spans[nspans++ % TRACELEN];
+	sp->name = name;
+	sp->start = start;
+	return sp->end = nowns();
+}
+
 void
 unmaplayersurface(LayerSurface *layersurface)
 {
@@ -2257,6 +4441,14 @@ unmaplayersurface(LayerSurface *layersurface)
 	motionnotify(0);
 }
 
+void
+unregisterclient(Client *c)
+{
+	/* Move the last entry into the hole to keep the array dense */
+	*c->st = cstate[--ncstate];
+	c->st->c->st = c->st;
+}
+
 void
 unmaplayersurfacenotify(struct wl_listener *listener, void *data)
 {
@@ -2270,14 +4462,30 @@ unmapnotify(struct wl_listener *listener, void *data)
 	/* Called when the surface is unmapped, and should no longer be shown. */
 	Client *c = wl_container_of(listener, c, unmap);
 	wl_list_remove(&c->link);
-	if (client_is_unmanaged(c))
+	if (client_is_unmanaged(c)) {
+#ifdef XWAYLAND
+		placeindependent(c, 0);
+#endif
 		return;
+	}
 
+	PROBE(unmapnotify, c, c->st->geom.x, c->st->geom.y, c->st->geom.width,
+			c->st->geom.height, c->st->tags);
+	record(RecUnmap, 0, c->id, 0, 0);
+	ipcclientevent("unmap", c);
 	setmon(c, NULL, 0);
 	wl_list_remove(&c->flink);
 	wl_list_remove(&c->slink);
 }
 
+void
+updateappid(struct wl_listener *listener, void *data)
+{
+	/* commits so far stay with the old app_id, appstats() looks up the new */
+	Client *c = wl_container_of(listener, c, setappid);
+	c->app = NULL;
+}
+
 void
 updatemons(struct wl_listener *listener, void *data)
 {
@@ -2291,6 +4499,9 @@ updatemons(struct wl_listener *listener, void *data)
 	struct wlr_output_configuration_v1 *config =
 		wlr_output_configuration_v1_create();
 	Monitor *m;
+#ifdef XWAYLAND
+	Client *c;
+#endif
 	sgeom = *wlr_output_layout_get_box(output_layout, NULL);
 	wl_list_for_each(m, &mons, link) {
 		struct wlr_output_configuration_head_v1 *config_head =
@@ -2311,10 +4522,31 @@ updatemons(struct wl_listener *listener, void *data)
 		config_head->state.x = m->m.x;
 		config_head->state.y = m->m.y;
 	}
+#ifdef XWAYLAND
+	/* Outputs moved, so independents may overlap different ones */
+	wl_list_for_each(c, &independents, link)
+		placeindependent(c, 1);
+#endif
 
 	wlr_output_manager_v1_set_configuration(output_mgr, config);
 }
 
+void
+updatetitle(struct wl_listener *listener, void *data)
+{
+	Client *c = wl_container_of(listener, c, settitle);
+	unsigned long match[BITWORDS(LENGTH(rules))];
+
+	/* Apply the rules a mapped client comes to match with its new title */
+	if (c->st->mon && c->matched) {
+		rulematch(c, match);
+		if (memcmp(match, c->matched, sizeof(match)))
+			reapplyrules(c, match);
+	}
+	if (c == selclient())
+		statechanged();
+}
+
 void
 view(const Arg *arg)
 {
@@ -2325,6 +4557,8 @@ view(const Arg *arg)
 		selmon->tagset[selmon->seltags] = arg->ui & TAGMASK;
 	focusclient(focustop(selmon), 1);
 	arrange(selmon);
+	ipcevent("tags\t%s\t%u", selmon->wlr_output->name,
+			selmon->tagset[selmon->seltags]);
 }
 
 void
@@ -2335,16 +4569,49 @@ virtualkeyboard(struct wl_listener *listener, void *data)
 	createkeyboard(device);
 }
 
+int
+writetrace(char *path, size_t size)
+{
+	/* Dump the spans of the last tracewindow seconds as Chrome trace JSON,
+	 * which chrome://tracing and ui.perfetto.dev both open */
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	uint64_t now = nowns(), since = now - MIN(now, tracewindow * 1000000000ULL);
+	uint64_t i = nspans > TRACELEN ? nspans - TRACELEN : 0;
+	const char *sep = "";
+	Span *sp;
+	FILE *f;
+
+	snprintf(path, size, "%s/dwl-trace-%d-%llu.json", dir ? dir : "/tmp",
+			(int)getpid(), (unsigned long long)(now / 1000000));
+	if (!(f = fopen(path, "w")))
+		return -1;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (; i != nspans; i++) {
+		sp = &spans[i % TRACELEN];
+		if (sp->end < since)
+			continue;
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,"
+				"\"ts\":%.3f,\"dur\":%.3f}", sep, sp->name, (int)getpid(),
+				sp->start / 1e3, (sp->end - sp->start) / 1e3);
+		sep = ",";
+	}
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0 ? 0 : -1;
+}
+
 Client *
 xytoclient(double x, double y)
 {
 	/* Find the topmost visible client (if any) at point (x, y), including
-	 * borders. This relies on stack being ordered from top to bottom. */
-	Client *c;
-	wl_list_for_each(c, &stack, slink)
-		if (VISIBLEON(c, c->mon) && wlr_box_contains_point(&c->geom, x, y))
-			return c;
-	return NULL;
+	 * borders. The one raised last in stack is on top. */
+	ClientState *s, *top = NULL;
+	hittests++;
+	for (s = cstate; s < cstate + ncstate; s++)
+		if (s->mon && ISVISIBLE(s, s->mon)
+				&& (!top || s->stackseq > top->stackseq)
+				&& wlr_box_contains_point(&s->geom, x, y))
+			top = s;
+	return top ? top->c : NULL;
 }
 
 struct wlr_surface *
@@ -2352,6 +4619,7 @@ xytolayersurface(struct wl_list *layer_surfaces, double x, double y,
 		double *sx, double *sy)
 {
 	LayerSurface *layersurface;
+	hittests++;
 	wl_list_for_each_reverse(layersurface, layer_surfaces, link) {
 		struct wlr_surface *sub;
 		if (!layersurface->layer_surface->mapped)
@@ -2380,13 +4648,13 @@ zoom(const Arg *arg)
 {
 	Client *c, *sel = selclient();
 
-	if (!sel || !selmon->lt[selmon->sellt]->arrange || sel->isfloating)
+	if (!sel || !selmon->lt[selmon->sellt]->arrange || sel->st->isfloating)
 		return;
 
 	/* Search for the first tiled window that is not sel, marking sel as
 	 * NULL if we pass it along the way */
 	wl_list_for_each(c, &clients, link)
-		if (VISIBLEON(c, selmon) && !c->isfloating) {
+		if (VISIBLEON(c, selmon) && !c->st->isfloating) {
 			if (c != sel)
 				break;
 			sel = NULL;
@@ -2418,13 +4686,33 @@ activatex11(struct wl_listener *listener, void *data)
 		wlr_xwayland_surface_activate(c->surface.xwayland, 1);
 }
 
+void
+closexcb(void)
+{
+	wl_event_source_remove(xcbsource);
+	xcb_disconnect(xc);
+	xcbsource = NULL;
+	xc = NULL;
+	syncevent = 0;
+}
+
 void
 configurex11(struct wl_listener *listener, void *data)
 {
 	Client *c = wl_container_of(listener, c, configure);
 	struct wlr_xwayland_surface_configure_event *event = data;
-	wlr_xwayland_surface_configure(c->surface.xwayland,
-			event->x, event->y, event->width, event->height);
+
+	/* Only the latest request counts; answer them all at once */
+	configrequests++;
+	c->configurereq.x = event->x;
+	c->configurereq.y = event->y;
+	c->configurereq.width = event->width;
+	c->configurereq.height = event->height;
+	if (wl_list_empty(&c->configlink))
+		wl_list_insert(configqueue.prev, &c->configlink);
+	if (!configidle)
+		configidle = wl_event_loop_add_idle(wl_display_get_event_loop(dpy),
+				flushconfigurestraced, NULL);
 }
 
 void
@@ -2433,15 +4721,17 @@ createnotifyx11(struct wl_listener *listener, void *data)
 	struct wlr_xwayland_surface *xwayland_surface = data;
 	Client *c;
 	wl_list_for_each(c, &clients, link)
-		if (c->isfullscreen && VISIBLEON(c, c->mon))
+		if (c->st->isfullscreen && VISIBLEON(c, c->st->mon))
 			setfullscreen(c, 0);
 
 	/* Allocate a Client for this surface */
-	c = xwayland_surface->data = calloc(1, sizeof(*c));
+	c = xwayland_surface->data = poolalloc(&clientpool);
+	registerclient(c);
 	c->surface.xwayland = xwayland_surface;
 	c->type = xwayland_surface->override_redirect ? X11Unmanaged : X11Managed;
-	c->bw = borderpx;
-	c->isfullscreen = 0;
+	c->st->bw = borderpx;
+	c->st->isfullscreen = 0;
+	wl_list_init(&c->configlink);
 
 	/* Listen to the various events it can emit */
 	LISTEN(&xwayland_surface->events.map, &c->map, mapnotify);
@@ -2453,75 +4743,367 @@ createnotifyx11(struct wl_listener *listener, void *data)
 	LISTEN(&xwayland_surface->events.destroy, &c->destroy, destroynotify);
 	LISTEN(&xwayland_surface->events.request_fullscreen, &c->fullscreen,
 			fullscreennotify);
+	LISTEN(&xwayland_surface->events.set_title, &c->settitle, updatetitle);
+	LISTEN(&xwayland_surface->events.set_class, &c->setappid, updateappid);
+	if (c->type == X11Unmanaged)
+		LISTEN(&xwayland_surface->events.set_geometry, &c->setgeometry,
+				setgeometryx11);
 }
 
-Atom
-getatom(xcb_connection_t *xc, const char *name)
+void
+fetchsynccounter(Client *c)
 {
-	Atom atom = 0;
-	xcb_intern_atom_reply_t *reply;
-	xcb_intern_atom_cookie_t cookie = xcb_intern_atom(xc, 0, strlen(name), name);
-	if ((reply = xcb_intern_atom_reply(xc, cookie, NULL)))
-		atom = reply->atom;
-	free(reply);
+	/* Clients taking part in _NET_WM_SYNC_REQUEST publish an XSync counter;
+	 * xcbready() sets an alarm on it once the property arrives.  Called at
+	 * map, once the SYNC extension is known, and whenever WM_PROTOCOLS or
+	 * the counter property changes. */
+	uint32_t window = c->surface.xwayland->window_id;
 
-	return atom;
+	if (!xc || syncevent <= 0 || c->syncalarm || c->synccookie)
+		return;
+	xcb_change_window_attributes(xc, window, XCB_CW_EVENT_MASK,
+			(uint32_t []){ XCB_EVENT_MASK_PROPERTY_CHANGE });
+	c->synccookie = xcb_get_property(xc, 0, window,
+			netatom[NetWMSyncRequestCounter], XCB_ATOM_CARDINAL, 0, 1).sequence;
+	xcb_flush(xc);
 }
 
 void
-renderindependents(struct wlr_output *output, struct timespec *now)
+flushconfigures(void *data)
+{
+	/* Answer the configure requests of this loop iteration.  Tiled and
+	 * fullscreen windows get the geometry dwl gave them, which ends the
+	 * back and forth with toolkits that keep asking for their own size;
+	 * floating and not yet mapped windows get what they asked for. */
+	Client *c, *tmp;
+	struct wlr_box *r;
+
+	configidle = NULL;
+	wl_list_for_each_safe(c, tmp, &configqueue, configlink) {
+		wl_list_remove(&c->configlink);
+		wl_list_init(&c->configlink);
+		r = &c->configurereq;
+		configsent++;
+		if (c->type == X11Managed && c->surface.xwayland->mapped && c->st->mon) {
+			if (c->st->isfloating && !c->st->isfullscreen)
+				resize(c, r->x, r->y, r->width + 2 * c->st->bw,
+						r->height + 2 * c->st->bw, 0);
+			else
+				resize(c, c->st->geom.x, c->st->geom.y,
+						c->st->geom.width, c->st->geom.height, 0);
+			continue;
+		}
+		wlr_xwayland_surface_configure(c->surface.xwayland,
+				r->x, r->y, r->width, r->height);
+		if (c->type == X11Unmanaged && c->surface.xwayland->mapped)
+			placeindependent(c, 1);
+	}
+}
+
+void
+placeindependent(Client *c, int mapped)
+{
+	/* Keep c in the bucket of every output it overlaps, in map order,
+	 * with its current geometry; unmapped clients are taken out. */
+	struct wlr_box geom = {
+		.x = c->surface.xwayland->x,
+		.y = c->surface.xwayland->y,
+		.width = c->surface.xwayland->width,
+		.height = c->surface.xwayland->height,
+	}, overlap;
+	Monitor *m;
+	size_t i, j;
+	int on;
+
+	wl_list_for_each(m, &mons, link) {
+		on = mapped && wlr_box_intersection(&overlap, &m->m, &geom);
+		i = 0;
+		while (i < m->nindep && m->indep[i].c != c)
+			i++;
+		if (i < m->nindep && on) {
+			m->indep[i].geom = geom;
+		} else if (i < m->nindep) {
+			m->nindep--;
+			memmove(&m->indep[i], &m->indep[i + 1],
+					(m->nindep - i) * sizeof(*m->indep));
+		} else if (on) {
+			if (m->nindep == m->indepcap) {
+				m->indepcap = m->indepcap ? m->indepcap * 2 : 8;
+				if (!(m->indep = realloc(m->indep,
+						m->indepcap * sizeof(*m->indep))))
+					EBARF("can't allocate independents");
+			}
+			j = m->nindep;
+			while (j > 0 && m->indep[j - 1].c->indepseq > c->indepseq)
+				j--;
+			memmove(&m->indep[j + 1], &m->indep[j],
+					(m->nindep - j) * sizeof(*m->indep));
+			m->indep[j].geom = geom;
+			m->indep[j].c = c;
+			m->nindep++;
+		}
+	}
+}
+
+void
+renderindependents(Monitor *m, struct timespec *now)
 {
-	Client *c;
 	struct render_data rdata;
-	struct wlr_box geom;
+	size_t i;
+
+	rdata.output = m->wlr_output;
+	rdata.when = now;
+	for (i = 0; i < m->nindep; i++) {
+		rdata.x = m->indep[i].geom.x;
+		rdata.y = m->indep[i].geom.y;
+		wlr_surface_for_each_surface(m->indep[i].c->surface.xwayland->surface,
+				render, &rdata);
+	}
+}
 
-	wl_list_for_each_reverse(c, &independents, link) {
-		geom.x = c->surface.xwayland->x;
-		geom.y = c->surface.xwayland->y;
-		geom.width = c->surface.xwayland->width;
-		geom.height = c->surface.xwayland->height;
+uint32_t
+sendsyncrequest(Client *c, uint32_t width, uint32_t height)
+{
+	/* Ask the client to bump its sync counter once it has redrawn at the
+	 * new size, and arm its alarm for that value.  Returns the serial
+	 * rendermon() waits on, or 0 if the client does not take part. */
+	xcb_client_message_event_t ev = {
+		.response_type = XCB_CLIENT_MESSAGE,
+		.format = 32,
+		.window = c->surface.xwayland->window_id,
+		.type = netatom[WMProtocols],
+	};
+	struct wlr_xwayland_surface *xs = c->surface.xwayland;
+	size_t i;
+
+	if (!xc || !c->syncalarm)
+		return 0;
+	/* the counter may outlive the protocol in WM_PROTOCOLS */
+	for (i = 0; i < xs->protocols_len; i++)
+		if (xs->protocols[i] == netatom[NetWMSyncRequest])
+			break;
+	if (i == xs->protocols_len)
+		return 0;
+	/* same size as the last configure: keep waiting on that one */
+	if (width == c->surface.xwayland->width && height == c->surface.xwayland->height)
+		return c->st->resize;
+
+	c->syncvalue++;
+	xcb_sync_change_alarm(xc, c->syncalarm, XCB_SYNC_CA_VALUE,
+			(uint32_t []){ c->syncvalue >> 32, c->syncvalue & 0xffffffff });
+	ev.data.data32[0] = netatom[NetWMSyncRequest];
+	ev.data.data32[1] = XCB_CURRENT_TIME;
+	ev.data.data32[2] = c->syncvalue & 0xffffffff;
+	ev.data.data32[3] = c->syncvalue >> 32;
+	xcb_send_event(xc, 0, ev.window, XCB_EVENT_MASK_NO_EVENT, (const char *)&ev);
+	xcb_flush(xc);
+	return c->syncvalue & 0xffffffff;
+}
 
-		/* Only render visible clients which show on this output */
-		if (!wlr_output_layout_intersects(output_layout, output, &geom))
-			continue;
+void
+setgeometryx11(struct wl_listener *listener, void *data)
+{
+	Client *c = wl_container_of(listener, c, setgeometry);
+	if (c->surface.xwayland->mapped)
+		placeindependent(c, 1);
+}
 
-		rdata.output = output;
-		rdata.when = now;
-		rdata.x = c->surface.xwayland->x;
-		rdata.y = c->surface.xwayland->y;
-		wlr_surface_for_each_surface(c->surface.xwayland->surface, render, &rdata);
+int
+wakexwayland(void *data)
+{
+	/* A lazily created XWayland starts on the first connection to its
+	 * socket; the X server accepts and drops this one once it is up. */
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int fd;
+
+	if (xc) /* already started by an X client */
+		return 0;
+	xwaylandspawn = nowns();
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/.X11-unix/X%d",
+			xwayland->server->display);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return 0;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			&& errno != EINPROGRESS && errno != EAGAIN)
+		fprintf(stderr, "xwayland: can't connect to %s: %s\n",
+				addr.sun_path, strerror(errno));
+	close(fd);
+	return 0;
+}
+
+int
+xcbready(int fd, uint32_t mask, void *data)
+{
+	xcb_generic_event_t *ev;
+	xcb_generic_error_t *error;
+	xcb_intern_atom_reply_t *reply;
+	xcb_get_property_reply_t *prop;
+	xcb_sync_alarm_notify_event_t *an;
+	xcb_property_notify_event_t *pn;
+	const xcb_query_extension_reply_t *ext;
+	Client *c;
+	uint64_t value;
+	int i, pending, progress;
+
+	if ((mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR)) || xcb_connection_has_error(xc)) {
+		/* The X server went away.  wlroots brings up a new one, eagerly
+		 * or on the next connection depending on how it was created;
+		 * unless we were asked to wait for X clients, connect now. */
+		closexcb();
+		xwaylandcrashed = 1;
+		if (xwaylandmode != XWaylandLazy)
+			wakexwayland(NULL);
+		return 0;
 	}
+
+	/* Reading events pulls everything off the socket, so the replies
+	 * are then answered from xcb's queue without blocking.  Go around
+	 * until neither turns anything up, as a reply poll may read more. */
+	do {
+		progress = pending = 0;
+		while ((ev = xcb_poll_for_event(xc))) {
+			progress = 1;
+			an = (xcb_sync_alarm_notify_event_t *)ev;
+			pn = (xcb_property_notify_event_t *)ev;
+			if (syncevent > 0 && (ev->response_type & 0x7f)
+					== syncevent + XCB_SYNC_ALARM_NOTIFY) {
+				value = (uint64_t)(uint32_t)an->counter_value.hi << 32
+						| an->counter_value.lo;
+				wl_list_for_each(c, &clients, link)
+					if (client_is_x11(c) && c->syncalarm == an->alarm
+							&& value >= c->syncvalue)
+						c->st->resize = 0;
+			} else if ((ev->response_type & 0x7f) == XCB_PROPERTY_NOTIFY
+					&& (pn->atom == netatom[WMProtocols]
+					|| pn->atom == netatom[NetWMSyncRequestCounter])) {
+				wl_list_for_each(c, &clients, link) {
+					if (!client_is_x11(c)
+							|| c->surface.xwayland->window_id != pn->window)
+						continue;
+					/* a read still in flight may predate the change, and
+					 * an alarm may watch a counter that is gone */
+					if (c->synccookie)
+						xcb_discard_reply(xc, c->synccookie);
+					if (c->syncalarm) {
+						xcb_sync_destroy_alarm(xc, c->syncalarm);
+						c->st->resize = 0;
+					}
+					c->synccookie = c->syncalarm = 0;
+					fetchsynccounter(c);
+				}
+			}
+			free(ev);
+		}
+
+		for (i = 0; i < NetLast; i++) {
+			if (!atomseq[i])
+				continue;
+			if (!xcb_poll_for_reply(xc, atomseq[i], (void **)&reply, &error)) {
+				pending++;
+				continue;
+			}
+			progress = 1;
+			if (reply)
+				netatom[i] = reply->atom;
+			free(reply);
+			free(error);
+			atomseq[i] = 0;
+		}
+
+		/* The SYNC query went out before the atoms, so once they are all
+		 * in, its reply is queued and this does not block. */
+		if (!pending && !syncevent) {
+			ext = xcb_get_extension_data(xc, &xcb_sync_id);
+			syncevent = ext && ext->present ? ext->first_event : -1;
+			if (syncevent > 0)
+				xcb_discard_reply(xc, xcb_sync_initialize(xc,
+						XCB_SYNC_MAJOR_VERSION, XCB_SYNC_MINOR_VERSION).sequence);
+			xcb_flush(xc);
+			/* clients mapped before this could not be asked yet */
+			wl_list_for_each(c, &clients, link)
+				if (client_is_x11(c))
+					fetchsynccounter(c);
+		}
+
+		wl_list_for_each(c, &clients, link) {
+			if (!client_is_x11(c) || !c->synccookie
+					|| !xcb_poll_for_reply(xc, c->synccookie, (void **)&prop, &error))
+				continue;
+			progress = 1;
+			c->synccookie = 0;
+			if (prop && prop->format == 32 && xcb_get_property_value_length(prop) == 4) {
+				c->syncalarm = xcb_generate_id(xc);
+				xcb_sync_create_alarm(xc, c->syncalarm, XCB_SYNC_CA_COUNTER
+						| XCB_SYNC_CA_VALUE_TYPE | XCB_SYNC_CA_TEST_TYPE
+						| XCB_SYNC_CA_EVENTS, (uint32_t []){
+						*(uint32_t *)xcb_get_property_value(prop),
+						XCB_SYNC_VALUETYPE_ABSOLUTE,
+						XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON, 1 });
+				xcb_flush(xc);
+			}
+			free(prop);
+			free(error);
+		}
+	} while (progress);
+	return 0;
 }
 
 void
 xwaylandready(struct wl_listener *listener, void *data)
 {
 	struct wlr_xcursor *xcursor;
-	xcb_connection_t *xc = xcb_connect(xwayland->display_name, NULL);
-	int err = xcb_connection_has_error(xc);
-	if (err) {
+	int err, i;
+
+	if (xwaylandspawn) {
+		xwaylandstartns[xwaylandcrashed] = nowns() - xwaylandspawn;
+		if (xwaylandcrashed)
+			fprintf(stderr, "xwayland: restarted in %.1f ms\n",
+					xwaylandstartns[1] / 1e6);
+		xwaylandspawn = 0;
+	}
+	if (xwaylandcrashed)
+		xwaylandrestarts++;
+	else
+		xwaylandstarts++;
+	xwaylandcrashed = 0;
+	/* wlroots forks XWayland from the pinned main loop */
+	if (compositorcpus || clientcpus)
+		sched_setaffinity(xwayland->server->pid, sizeof(clientmask), &clientmask);
+
+	if (xc)
+		closexcb();
+	xc = xcb_connect(xwayland->display_name, NULL);
+	if ((err = xcb_connection_has_error(xc))) {
 		fprintf(stderr, "xcb_connect to X server failed with code %d\n. Continuing with degraded functionality.\n", err);
+		xcb_disconnect(xc);
+		xc = NULL;
 		return;
 	}
 
-	/* Collect atoms we are interested in.  If getatom returns 0, we will
-	 * not detect that window type. */
-	netatom[NetWMWindowTypeDialog] = getatom(xc, "_NET_WM_WINDOW_TYPE_DIALOG");
-	netatom[NetWMWindowTypeSplash] = getatom(xc, "_NET_WM_WINDOW_TYPE_SPLASH");
-	netatom[NetWMWindowTypeToolbar] = getatom(xc, "_NET_WM_WINDOW_TYPE_TOOLBAR");
-	netatom[NetWMWindowTypeUtility] = getatom(xc, "_NET_WM_WINDOW_TYPE_UTILITY");
+	/* Ask for SYNC and all atoms at once; xcbready() collects the replies.
+	 * Until an atom arrives it stays 0 and we will not detect that window
+	 * type. */
+	xcb_prefetch_extension_data(xc, &xcb_sync_id);
+	for (i = 0; i < NetLast; i++)
+		atomseq[i] = xcb_intern_atom(xc, 0, strlen(netatomnames[i]),
+				netatomnames[i]).sequence;
+	xcb_flush(xc);
+	xcbsource = wl_event_loop_add_fd(wl_display_get_event_loop(dpy),
+			xcb_get_file_descriptor(xc), WL_EVENT_READABLE, xcbreadytraced, NULL);
 
 	/* assign the one and only seat */
 	wlr_xwayland_set_seat(xwayland, seat);
 
-	/* Set the default XWayland cursor to match the rest of dwl. */
+	/* Set the default XWayland cursor to match the rest of dwl.  The
+	 * theme may still be waiting for the first frame, see loadcursors(). */
+	wlr_xcursor_manager_load(cursor_mgr, 1);
 	if ((xcursor = wlr_xcursor_manager_get_xcursor(cursor_mgr, "left_ptr", 1)))
 		wlr_xwayland_set_cursor(xwayland,
 				xcursor->images[0]->buffer, xcursor->images[0]->width * 4,
 				xcursor->images[0]->width, xcursor->images[0]->height,
 				xcursor->images[0]->hotspot_x, xcursor->images[0]->hotspot_y);
 
-	xcb_disconnect(xc);
+	startupmark("xwayland ready");
 }
 
 Client *
@@ -2532,17 +5114,14 @@ xytoindependent(double x, double y)
 	 * We rely on the X11 convention of unmapping unmanaged when the "owning"
 	 * client loses focus, which ensures that unmanaged are only visible on
 	 * the current tag. */
-	Client *c;
-	wl_list_for_each_reverse(c, &independents, link) {
-		struct wlr_box geom = {
-			.x = c->surface.xwayland->x,
-			.y = c->surface.xwayland->y,
-			.width = c->surface.xwayland->width,
-			.height = c->surface.xwayland->height,
-		};
-		if (wlr_box_contains_point(&geom, x, y))
-			return c;
-	}
+	Monitor *m = xytomon(x, y);
+	size_t i;
+	hittests++;
+	if (!m)
+		return NULL;
+	for (i = m->nindep; i-- > 0;)
+		if (wlr_box_contains_point(&m->indep[i].geom, x, y))
+			return m->indep[i].c;
 	return NULL;
 }
 #endif
@@ -2550,13 +5129,18 @@ xytoindependent(double x, double y)
 int
 main(int argc, char *argv[])
 {
-	char *startup_cmd = NULL;
+	char *startup_cmd = NULL, *recordpath = NULL;
 	int c;
 
-	while ((c = getopt(argc, argv, "s:h")) != -1) {
+	startuptime = nowns();
+	while ((c = getopt(argc, argv, "s:R:P:h")) != -1) {
 		if (c == 's')
 			startup_cmd = optarg;
-		else
+		else if (c == 'R')
+			recordpath = optarg;
+		else if (c == 'P' && !(replayfp = fopen(optarg, "r")))
+			EBARF("can't open %s", optarg);
+		else if (c != 'P')
 			goto usage;
 	}
 	if (optind < argc)
@@ -2567,10 +5151,11 @@ main(int argc, char *argv[])
 	if (!getenv("XDG_RUNTIME_DIR"))
 		BARF("XDG_RUNTIME_DIR must be set");
 	setup();
-	run(startup_cmd);
+	startupmark("setup done");
+	run(startup_cmd, recordpath);
 	cleanup();
 	return EXIT_SUCCESS;
 
 usage:
-	BARF("Usage: %s [-s startup command]", argv[0]);
+	BARF("Usage: %s [-s startup command] [-R record file] [-P replay file]", argv[0]);
 }